@@ -0,0 +1,350 @@
+/*
+ * Replays an allocation trace against whichever allocator it is linked
+ * with (bench1 to bench5 or bench_glibc) and reports throughput, latency
+ * percentiles, peak RSS and fragmentation.
+ *
+ * Usage: bench [-w workload | -t trace] [-n ops] [-l live] [-m heap]
+ *              [-g] [-H] [-N] [-s seed] [-o out] [-b]
+ *   -w  generate a trace: 1 (16 bytes), 2 (16, 80 or 256 bytes),
+ *       3 (any size), random (1 to 4096 bytes) or prodcons (objects are
+ *       freed in the order they were allocated)
+ *   -t  replay a trace file instead
+ *   -n  operations to generate (default 1000000)
+ *   -l  objects to keep alive at once (default 1000)
+ *   -m  bytes to pass to Mem_Init (default 1 MiB)
+ *   -g  let the heap grow (MEM_GROW)
+ *   -H  map the heap from the hugetlb pool (MEM_HUGETLB)
+ *   -N  keep memory on the local NUMA node (MEM_NUMA)
+ *   -s  random seed
+ *   -o  write the trace to a file instead of running it, binary with -b
+ *
+ * A text trace has one operation per line:
+ *   a <id> <size>    allocate size bytes and call the result id
+ *   r <id> <size>    realloc id to size bytes
+ *   f <id>           free id
+ * A binary trace starts with the 8 bytes "MEMTRACE" followed by
+ * trace_record structs in host byte order.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <libgen.h>
+#include <sys/resource.h>
+#include "mem.h"
+
+#define TRACE_MAGIC "MEMTRACE"
+
+typedef struct trace_record {
+  char op;       // 'a', 'r' or 'f'
+  char pad[3];
+  uint32_t id;   // which object
+  uint32_t size; // bytes, unused for 'f'
+} trace_record;
+
+trace_record* trace = NULL;
+int trace_len = 0;
+int trace_cap = 0;
+int max_id = 0;
+
+void add_op(char op, int id, int size) {
+  if (trace_len == trace_cap) {
+    trace_cap = trace_cap ? trace_cap * 2 : 4096;
+    trace = realloc(trace, trace_cap * sizeof(trace_record));
+    if (trace == NULL) {
+      fprintf(stderr, "out of memory\n");
+      exit(1);
+    }
+  }
+  trace[trace_len].op = op;
+  trace[trace_len].id = id;
+  trace[trace_len].size = size;
+  trace_len++;
+  if (id >= max_id) {
+    max_id = id + 1;
+  }
+}
+
+// A size in [lo, hi] whose log is uniformly distributed, so that small
+// sizes are as common as they are in real programs
+int log_uniform(int lo, int hi) {
+  int bits = 0;
+  int size;
+
+  while ((lo << bits) < hi) {
+    bits++;
+  }
+  size = lo << (rand() % (bits + 1));
+  size += rand() % size;
+  return size < lo ? lo : (size > hi ? hi : size);
+}
+
+int workload_size(char* workload) {
+  static int sizes[] = {16, 80, 256};
+
+  if (!strcmp(workload, "1")) {
+    return 16;
+  } else if (!strcmp(workload, "2")) {
+    return sizes[rand() % 3];
+  } else if (!strcmp(workload, "3")) {
+    return log_uniform(1, 65536);
+  } else if (!strcmp(workload, "random")) {
+    return rand() % 4096 + 1;
+  }
+  return log_uniform(16, 4096);
+}
+
+// Make a trace of about ops operations that keeps roughly live objects
+// alive. Objects die at random, or oldest first for prodcons.
+void generate(char* workload, int ops, int live) {
+  int* ids = malloc(sizeof(int) * live);
+  int count = 0;  // objects alive
+  int oldest = 0; // prodcons: where the oldest object is in ids
+  int next_id = 0;
+  int fifo = !strcmp(workload, "prodcons");
+  int i, victim;
+
+  if (ids == NULL) {
+    fprintf(stderr, "out of memory\n");
+    exit(1);
+  }
+  if (!fifo && strcmp(workload, "1") && strcmp(workload, "2") &&
+      strcmp(workload, "3") && strcmp(workload, "random")) {
+    fprintf(stderr, "unknown workload %s\n", workload);
+    exit(1);
+  }
+
+  for (i = 0; i < ops; i++) {
+    // Allocate more often while there are fewer than live objects
+    if (count == 0 || (count < live && rand() % (2 * live) >= count)) {
+      ids[(oldest + count) % live] = next_id;
+      add_op('a', next_id++, workload_size(workload));
+      count++;
+    } else if (fifo) {
+      add_op('f', ids[oldest], 0);
+      oldest = (oldest + 1) % live;
+      count--;
+    } else {
+      victim = rand() % count;
+      if (strcmp(workload, "1") && rand() % 10 == 0) {
+        add_op('r', ids[victim], workload_size(workload));
+      } else {
+        add_op('f', ids[victim], 0);
+        ids[victim] = ids[count - 1];
+        count--;
+      }
+    }
+  }
+
+  // Free whatever is left so every run ends with an empty heap
+  while (count > 0) {
+    add_op('f', ids[(oldest + count - 1) % live], 0);
+    count--;
+  }
+  free(ids);
+}
+
+void load(char* path) {
+  FILE* file = fopen(path, "r");
+  char magic[sizeof(TRACE_MAGIC) - 1];
+  trace_record record;
+  char op;
+  int id, size;
+
+  if (file == NULL) {
+    perror(path);
+    exit(1);
+  }
+
+  if (fread(magic, 1, sizeof(magic), file) == sizeof(magic) &&
+      !memcmp(magic, TRACE_MAGIC, sizeof(magic))) {
+    while (fread(&record, sizeof(record), 1, file) == 1) {
+      add_op(record.op, record.id, record.size);
+    }
+  } else {
+    rewind(file);
+    while (fscanf(file, " %c %d", &op, &id) == 2) {
+      size = 0;
+      if (op != 'f' && fscanf(file, "%d", &size) != 1) {
+        fprintf(stderr, "%s: bad trace line at op %d\n", path, trace_len);
+        exit(1);
+      }
+      add_op(op, id, size);
+    }
+  }
+  fclose(file);
+}
+
+void save(char* path, int binary) {
+  FILE* file = fopen(path, "w");
+  int i;
+
+  if (file == NULL) {
+    perror(path);
+    exit(1);
+  }
+  if (binary) {
+    fwrite(TRACE_MAGIC, 1, sizeof(TRACE_MAGIC) - 1, file);
+    fwrite(trace, sizeof(trace_record), trace_len, file);
+  } else {
+    for (i = 0; i < trace_len; i++) {
+      if (trace[i].op == 'f') {
+        fprintf(file, "f %u\n", trace[i].id);
+      } else {
+        fprintf(file, "%c %u %u\n", trace[i].op, trace[i].id, trace[i].size);
+      }
+    }
+  }
+  fclose(file);
+}
+
+// Where the trace has the most bytes live, which is where fragmentation
+// is worth measuring
+int find_peak() {
+  int* sizes = calloc(max_id, sizeof(int));
+  long live = 0, peak = 0;
+  int i, peak_at = 0;
+
+  for (i = 0; i < trace_len; i++) {
+    live -= sizes[trace[i].id];
+    sizes[trace[i].id] = trace[i].op == 'f' ? 0 : trace[i].size;
+    live += sizes[trace[i].id];
+    if (live > peak) {
+      peak = live;
+      peak_at = i;
+    }
+  }
+  free(sizes);
+  return peak_at;
+}
+
+long now_ns() {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000L + now.tv_nsec;
+}
+
+int compare_long(const void* a, const void* b) {
+  long x = *(long*) a, y = *(long*) b;
+
+  return (x > y) - (x < y);
+}
+
+int main(int argc, char* argv[]) {
+  char* workload = "3";
+  char* trace_path = NULL;
+  char* out_path = NULL;
+  int ops = 1000000, live = 1000, heap = 1 << 20;
+  int flags = 0, binary = 0, failed = 0;
+  int opt, i, peak_at;
+  void** objects;
+  void* ptr;
+  long* latency;
+  long start, begin, total;
+  struct mem_stats stats;
+  struct rusage usage;
+
+  srand(1);
+  while ((opt = getopt(argc, argv, "w:t:n:l:m:gHNs:o:b")) != -1) {
+    switch (opt) {
+    case 'w': workload = optarg; break;
+    case 't': trace_path = optarg; break;
+    case 'n': ops = atoi(optarg); break;
+    case 'l': live = atoi(optarg); break;
+    case 'm': heap = atoi(optarg); break;
+    case 'g': flags |= MEM_GROW; break;
+    case 'H': flags |= MEM_HUGETLB; break;
+    case 'N': flags |= MEM_NUMA; break;
+    case 's': srand(atoi(optarg)); break;
+    case 'o': out_path = optarg; break;
+    case 'b': binary = 1; break;
+    default:
+      fprintf(stderr, "Usage: %s [-w workload | -t trace] [-n ops] [-l live] "
+              "[-m heap] [-g] [-H] [-N] [-s seed] [-o out] [-b]\n", argv[0]);
+      exit(1);
+    }
+  }
+  if (ops <= 0 || live <= 0) {
+    fprintf(stderr, "error: ops and live must be > 0\n");
+    exit(1);
+  }
+
+  if (trace_path != NULL) {
+    load(trace_path);
+    workload = basename(trace_path);
+  } else {
+    generate(workload, ops, live);
+  }
+  if (out_path != NULL) {
+    save(out_path, binary);
+    return 0;
+  }
+
+  objects = calloc(max_id, sizeof(void*));
+  latency = malloc(sizeof(long) * trace_len);
+  if (objects == NULL || latency == NULL) {
+    fprintf(stderr, "out of memory\n");
+    exit(1);
+  }
+  peak_at = find_peak();
+  memset(&stats, 0, sizeof(stats));
+
+  if (Mem_InitFlags(heap, flags) != 0) {
+    fprintf(stderr, "error: Mem_Init(%d) failed\n", heap);
+    exit(1);
+  }
+
+  total = 0;
+  for (i = 0; i < trace_len; i++) {
+    trace_record* r = &trace[i];
+
+    start = now_ns();
+    if (r->op == 'a') {
+      ptr = Mem_Alloc(r->size);
+      objects[r->id] = ptr;
+    } else if (r->op == 'r') {
+      ptr = Mem_Realloc(objects[r->id], r->size);
+      if (ptr != NULL) {
+        objects[r->id] = ptr;
+      }
+    } else {
+      ptr = objects[r->id];
+      if (ptr != NULL) {
+        Mem_Free(ptr);
+        objects[r->id] = NULL;
+      }
+    }
+    latency[i] = now_ns() - start;
+    total += latency[i];
+
+    if (ptr == NULL && r->op != 'f') {
+      failed++;
+    } else if (ptr != NULL && r->op != 'f') {
+      ((char*) ptr)[0] = 1; // touch it like a real program would
+    }
+    if (i == peak_at) {
+      begin = now_ns();
+      Mem_Stats(&stats);
+      total -= now_ns() - begin;
+    }
+  }
+
+  getrusage(RUSAGE_SELF, &usage);
+  qsort(latency, trace_len, sizeof(long), compare_long);
+
+  printf("%-12s %-10s %9d ops %12.0f ops/s  p50 %5ld ns  p99 %6ld ns  "
+         "p999 %7ld ns  rss %7ld KiB  frag %.3f  failed %d\n",
+         basename(argv[0]), workload, trace_len, trace_len / (total / 1e9),
+         latency[trace_len / 2], latency[(long) trace_len * 99 / 100],
+         latency[(long) trace_len * 999 / 1000], usage.ru_maxrss,
+         stats.fragmentation, failed);
+
+  free(latency);
+  free(objects);
+  free(trace);
+  return 0;
+}
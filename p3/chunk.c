@@ -0,0 +1,249 @@
+/*
+ * Chunk management shared by the allocators: mapping the region given to
+ * Mem_Init(), growing the heap with more regions on demand, and giving
+ * empty regions back to the system. Where the memory comes from (huge
+ * pages, NUMA nodes) is decided here too.
+ */
+
+#define _GNU_SOURCE // getcpu()
+#include <sched.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <stdint.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#include "mem.h"
+#include "chunk.h"
+
+#define HUGEPAGE_SIZE (2 * 1024 * 1024)
+#define CHUNK_MAX (1 << 30) // growth stops doubling here (block sizes are ints)
+#define CHUNK_FENCE 16      // gap left at the end of a grown chunk
+
+// Grown chunks keep their descriptor at the front and a fence at the back,
+// so the last block of one chunk can never look adjacent to the first block
+// of another chunk that happens to be mapped right after it.
+#define CHUNK_OVERHEAD (sizeof(chunk) + CHUNK_FENCE)
+
+chunk* chunk_list = NULL; // every mapped chunk, the Mem_Init() region first
+chunk first_chunk;        // descriptor for the Mem_Init() region
+size_t grow_size = 0;     // size of the last chunk mapped for growth
+int chunk_placement = 0;  // MEM_HUGETLB and MEM_NUMA from Mem_InitFlags()
+
+// Round size up to whole pages, or whole huge pages once it is that large
+size_t chunk_round(size_t size) {
+  size_t unit = getpagesize();
+
+  if (size >= HUGEPAGE_SIZE) {
+    unit = HUGEPAGE_SIZE;
+  }
+  return (size + unit - 1) / unit * unit;
+}
+
+// How big the next chunk should be to fit needed bytes: twice the last one
+size_t chunk_grow_size(size_t needed) {
+  size_t size;
+
+  if (needed > CHUNK_MAX - CHUNK_OVERHEAD) {
+    return 0; // too big for one chunk
+  }
+  if (grow_size != 0) {
+    size = grow_size * 2;
+  } else {
+    size = chunk_list->map_size;
+  }
+  if (size > CHUNK_MAX) {
+    size = CHUNK_MAX;
+  }
+  needed += CHUNK_OVERHEAD;
+  if (size < needed) {
+    size = needed;
+  }
+  return chunk_round(size);
+}
+
+// The NUMA node of the CPU this thread is running on, or -1 if MEM_NUMA is
+// off or the node can't be found out
+int chunk_local_node() {
+  unsigned int cpu, node;
+
+  if (!(chunk_placement & MEM_NUMA) || getcpu(&cpu, &node) != 0) {
+    return -1;
+  }
+  return node;
+}
+
+// Ask for the pages of a region to come from node. This is only a
+// preference, so the kernel still uses other nodes once this one is full,
+// and on a kernel without NUMA support it does nothing at all.
+void bind_node(char* ptr, size_t size, int node) {
+  unsigned long mask[4] = {0}; // room for 256 nodes
+  int bits = 8 * sizeof(unsigned long);
+
+  if (node < 0 || node >= 4 * bits) {
+    return;
+  }
+  mask[node / bits] |= 1UL << (node % bits);
+  syscall(SYS_mbind, ptr, size, MPOL_PREFERRED, mask, 4 * bits, 0);
+}
+
+// Map size bytes from the hugetlb pool, or return NULL if MEM_HUGETLB is
+// off, size isn't a whole number of huge pages or the pool is empty (which
+// it is unless the system administrator has set it up)
+char* map_hugetlb(size_t size) {
+#ifdef MAP_HUGETLB
+  char* map_ptr;
+
+  if (!(chunk_placement & MEM_HUGETLB) || size % HUGEPAGE_SIZE) {
+    return NULL;
+  }
+  map_ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+  if (map_ptr != MAP_FAILED) {
+    return map_ptr;
+  }
+#endif
+  return NULL;
+}
+
+// Map size bytes of /dev/zero. Large regions are aligned to a huge page so
+// the kernel can back them with transparent huge pages.
+char* map_pages(size_t size) {
+  int fd;
+  char* map_ptr;
+  char* aligned;
+  size_t slack = 0;
+
+  fd = open("/dev/zero", O_RDWR);
+  if (fd == -1) {
+    return NULL;
+  }
+
+  if (size >= HUGEPAGE_SIZE) {
+    slack = HUGEPAGE_SIZE;
+  }
+  map_ptr = mmap(NULL, size + slack, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map_ptr == MAP_FAILED) {
+    return NULL;
+  }
+
+  // Trim the over-mapping so that what is left starts on a huge page
+  if (slack) {
+    aligned = (char*) (((uintptr_t) map_ptr + HUGEPAGE_SIZE - 1) & ~((uintptr_t) HUGEPAGE_SIZE - 1));
+    if (aligned != map_ptr) {
+      munmap(map_ptr, aligned - map_ptr);
+    }
+    if (aligned + size != map_ptr + size + slack) {
+      munmap(aligned + size, (map_ptr + size + slack) - (aligned + size));
+    }
+    map_ptr = aligned;
+#ifdef MADV_HUGEPAGE
+    madvise(map_ptr, size, MADV_HUGEPAGE);
+#endif
+  }
+  return map_ptr;
+}
+
+// Map a zeroed region of size bytes, from the hugetlb pool if it can be,
+// with its pages placed on NUMA node node (-1 for anywhere)
+char* chunk_map_region(size_t size, int node) {
+  char* map_ptr;
+
+  if (size == 0) {
+    return NULL;
+  }
+  map_ptr = map_hugetlb(size);
+  if (map_ptr == NULL) {
+    map_ptr = map_pages(size);
+  }
+  if (map_ptr != NULL) {
+    bind_node(map_ptr, size, node);
+  }
+  return map_ptr;
+}
+
+// Map a chunk of size bytes on the caller's NUMA node and add it to the
+// chunk list
+chunk* chunk_map(size_t size) {
+  char* map_ptr;
+  chunk* c;
+  chunk* last;
+  int node = chunk_local_node();
+
+  map_ptr = chunk_map_region(size, node);
+  if (map_ptr == NULL) {
+    return NULL;
+  }
+
+  if (chunk_list == NULL) {
+    c = &first_chunk;
+    c->start = map_ptr;
+    c->end = map_ptr + size;
+  } else {
+    c = (chunk*) map_ptr;
+    c->start = map_ptr + sizeof(chunk);
+    c->end = map_ptr + size - CHUNK_FENCE;
+    grow_size = size;
+  }
+  c->map_start = map_ptr;
+  c->map_size = size;
+  c->used = 0;
+  c->node = node;
+  c->next = NULL;
+
+  if (chunk_list == NULL) {
+    chunk_list = c;
+  } else {
+    last = chunk_list;
+    while (last->next != NULL) {
+      last = last->next;
+    }
+    last->next = c;
+  }
+  return c;
+}
+
+// Take a grown chunk off the list and give it back to the system
+void chunk_unmap(chunk* c) {
+  chunk* prev = chunk_list;
+  char* map_start = c->map_start;
+  size_t map_size = c->map_size;
+
+  if (c == chunk_list) {
+    return; // the Mem_Init() region is never unmapped
+  }
+  while (prev->next != c) {
+    prev = prev->next;
+  }
+  prev->next = c->next;
+  munmap(map_start, map_size);
+}
+
+// The chunk that ptr points into, or NULL if it isn't in the heap
+chunk* chunk_find(void* ptr) {
+  chunk* c = chunk_list;
+
+  while (c != NULL) {
+    if ((char*) ptr >= c->start && (char*) ptr < c->end) {
+      return c;
+    }
+    c = c->next;
+  }
+  return NULL;
+}
+
+// True if the empty chunk c should be unmapped. heap_free is the free space
+// in the whole heap, c included. An empty chunk is kept mapped as headroom
+// until the rest of the heap has at least as much free space as c would
+// give back. This stops a heap that hovers around a chunk boundary from
+// mapping and unmapping the same chunk over and over.
+int chunk_should_unmap(chunk* c, long heap_free) {
+  long size = c->end - c->start;
+
+  if (c == chunk_list) {
+    return 0;
+  }
+  return heap_free - size >= size;
+}
@@ -0,0 +1,31 @@
+#ifndef _CHUNK_H_
+#define _CHUNK_H_
+
+#include <stddef.h>
+
+// A chunk is one mmap()ed region that an allocator carves its blocks out of.
+// The region mapped by Mem_Init() is always the first chunk on the list. In
+// growth mode more chunks are mapped on demand and appended to the list.
+typedef struct chunk {
+  char* start;         // first byte the allocator may use
+  char* end;           // one past the last byte the allocator may use
+  char* map_start;     // what was handed back by mmap()
+  size_t map_size;     // how many bytes were mapped
+  int used;            // live allocations in this chunk, kept by the allocator
+  int node;            // NUMA node the chunk was placed on, or -1
+  struct chunk* next;
+} chunk;
+
+extern chunk* chunk_list;
+extern int chunk_placement;
+
+size_t chunk_round(size_t size);
+size_t chunk_grow_size(size_t needed);
+int chunk_local_node();
+char* chunk_map_region(size_t size, int node);
+chunk* chunk_map(size_t size);
+void chunk_unmap(chunk* c);
+chunk* chunk_find(void* ptr);
+int chunk_should_unmap(chunk* c, long free_bytes);
+
+#endif // _CHUNK_H_
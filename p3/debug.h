@@ -0,0 +1,60 @@
+#ifndef _DEBUG_H_
+#define _DEBUG_H_
+
+#include <stdio.h>
+
+// Report a problem that Mem_Check() found. Always returns -1.
+static inline int check_failed(const char* what, void* where) {
+  fprintf(stderr, "Mem_Check: %s at %p\n", what, where);
+  return -1;
+}
+
+// "make DEBUG=1" builds fill freed memory with POISON and look for it to
+// still be there when the memory is handed out again. In other builds all
+// of this is empty and costs nothing.
+#ifdef MEM_DEBUG
+#include <stdlib.h>
+#include <string.h>
+
+#define POISON 0xdd
+
+// Something has gone badly wrong, so stop before it gets worse
+static inline void debug_fail(const char* what, void* where) {
+  fprintf(stderr, "mem: %s at %p\n", what, where);
+  abort();
+}
+
+static inline void debug_poison(void* ptr, long size) {
+  if (size > 0) {
+    memset(ptr, POISON, size);
+  }
+}
+
+// The first of the size bytes at ptr that isn't POISON, or NULL
+static inline void* debug_unpoisoned(void* ptr, long size) {
+  unsigned char* bytes = (unsigned char*) ptr;
+  long i;
+
+  for (i = 0; i < size; i++) {
+    if (bytes[i] != POISON) {
+      return bytes + i;
+    }
+  }
+  return NULL;
+}
+
+// Abort unless the size bytes at ptr are all still POISON, because if they
+// aren't something wrote to the memory after it was freed
+static inline void debug_check_poison(void* ptr, long size) {
+  void* bad = debug_unpoisoned(ptr, size);
+
+  if (bad != NULL) {
+    debug_fail("write after free", bad);
+  }
+}
+#else
+#define debug_poison(ptr, size) ((void) 0)
+#define debug_check_poison(ptr, size) ((void) 0)
+#endif
+
+#endif // _DEBUG_H_
@@ -1,14 +1,52 @@
 #ifndef _MEM_H_
 #define _MEM_H_
 
+// Flags for Mem_InitFlags()
+#define MEM_GROW 0x1  // map more memory when the heap is full instead of failing
+#define MEM_GUARD 0x2 // debug builds: end big blocks right before an inaccessible page
+#define MEM_HUGETLB 0x4 // map big regions from the hugetlb pool when it has room
+#define MEM_NUMA 0x8  // place memory on the NUMA node of the thread that maps it
+
+#define MEM_HIST_BUCKETS 32
+
+// Allocator health, filled in by Mem_Stats(). Histogram bucket i counts
+// values in [2^i, 2^(i+1)).
+struct mem_stats {
+  long in_use;          // bytes handed out, after rounding
+  long free;            // bytes in free blocks
+  long largest_free;    // the largest free block
+  long free_blocks;     // how many free blocks there are
+  double fragmentation; // 1 - largest_free / free
+  long allocs;          // successful allocations
+  long frees;           // successful frees
+  long size_hist[MEM_HIST_BUCKETS];    // allocations by (rounded) size
+  long free_hist[MEM_HIST_BUCKETS];    // free blocks by size
+  long alloc_cycles[MEM_HIST_BUCKETS]; // Mem_Alloc() calls by cycles taken (MEM_TIMING builds only)
+  long free_cycles[MEM_HIST_BUCKETS];  // Mem_Free() calls by cycles taken (MEM_TIMING builds only)
+};
+
 int Mem_Init(int size);
 
+int Mem_InitFlags(int size, int flags);
+
 void* Mem_Alloc(int size);
 
+void* Mem_AllocAligned(int size, int align);
+
+void* Mem_Calloc(int count, int size);
+
+void* Mem_Realloc(void* ptr, int size);
+
 int Mem_Free(void* ptr);
 
+int Mem_UsableSize(void* ptr);
+
 int Mem_Available();
 
 void Mem_Dump();
 
+void Mem_Stats(struct mem_stats* stats);
+
+int Mem_Check();
+
 #endif // _MEM_H_
@@ -12,6 +12,9 @@
 #include <string.h>
 #include <stdint.h>
 #include "mem.h"
+#include "chunk.h"
+#include "stats.h"
+#include "debug.h"
 
 #define BLOCKSIZE 16 
 
@@ -22,15 +25,71 @@ typedef struct block_header{
 char* start;        // The start of the memory space from Mem_Init()
 char* end;          // The end of the memory space from Mem_Init()
 block_header* head; // The head of the free list
-int num_blocks;     // The number of blocks that can fit into the space from Mem_Init()
+int num_blocks;     // The number of blocks that can fit into the heap
 int free_space;     // The amount of free space available 
+int grow = 0;       // True if more chunks are mapped when the pool runs out
+struct mem_stats stats; // The counters for Mem_Stats() that the pool doesn't already keep
+
+// Build the memory pool in chunk c (a linked list with fixed sized segments)
+// and put it in front of the free list
+void add_blocks(chunk* c) {
+  int i;
+  int chunk_blocks = (c->end - c->start) / BLOCKSIZE;
+  block_header* curr = (block_header*) c->start;
+
+  for (i = 1; i < chunk_blocks; i++) {
+    block_header* new_block = (block_header*) ((char*) curr + BLOCKSIZE);
+    curr->next = new_block;
+    debug_poison(curr + 1, BLOCKSIZE - sizeof(block_header));
+    curr = new_block;
+  }
+  curr->next = head;
+  debug_poison(curr + 1, BLOCKSIZE - sizeof(block_header));
+  head = (block_header*) c->start;
+
+  num_blocks += chunk_blocks;
+  free_space += chunk_blocks * BLOCKSIZE;
+}
+
+// Map another chunk, twice as big as the last one, and add it to the pool
+int grow_pool() {
+  chunk* c = chunk_map(chunk_grow_size(BLOCKSIZE));
+
+  if (c == NULL) {
+    return -1;
+  }
+  add_blocks(c);
+  return 0;
+}
+
+// Give an empty grown chunk back to the system. Its blocks are spread
+// through the free list, so they have to be unlinked one by one first.
+void release_chunk(chunk* c) {
+  block_header** link = &head;
+  int chunk_blocks = (c->end - c->start) / BLOCKSIZE;
+
+  while (*link != NULL) {
+    if ((char*) *link >= c->start && (char*) *link < c->end) {
+      *link = (*link)->next;
+    } else {
+      link = &(*link)->next;
+    }
+  }
+  num_blocks -= chunk_blocks;
+  free_space -= chunk_blocks * BLOCKSIZE;
+  chunk_unmap(c);
+}
 
 int Mem_Init(int size) {
+  return Mem_InitFlags(size, 0);
+}
+
+int Mem_InitFlags(int size, int flags) {
   static int already_called = 0; // this function can only be called once
   int pagesize;
   int extra_bytes;
   int total_size;
-  int fd;
+  chunk* c;
 
   if(already_called || size <= 0) {
     return -1;
@@ -43,40 +102,28 @@ int Mem_Init(int size) {
   extra_bytes = (pagesize - extra_bytes) % pagesize;
 
   total_size = size + extra_bytes;
-  free_space = total_size;
-  num_blocks = total_size / BLOCKSIZE;
 
-  fd = open("/dev/zero", O_RDWR);
-  if(fd == -1) {
+  chunk_placement = flags & (MEM_HUGETLB | MEM_NUMA);
+  c = chunk_map(total_size);
+  if (c == NULL) {
     return -1;
   }
-  
-  start = mmap(NULL, total_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
-  if (start == MAP_FAILED) {
-    return -1;
-  }
-  end = start + total_size;
+  start = c->start;
+  end = c->end;
+  head = NULL;
+  add_blocks(c);
  
-  head = (block_header*)start;
-  
-  // Build the memory pool (a linked list with fixed sized segments)
-  int i;
-  block_header* curr = head;
-  for (i = 1; i < num_blocks; i++) {
-    block_header* new_block = (block_header*) ((char*) curr + BLOCKSIZE);
-    curr->next = new_block;
-    curr = new_block;
-  }
-  curr->next = NULL;
-  
+  grow = flags & MEM_GROW;
   already_called = 1; 
-  close(fd);
   return 0;
 }
 
-void* Mem_Alloc(int size) {
+void* alloc_block(int size) {
 
-  if (size != 16 || free_space < 48 ) {
+  if (size != 16) {
+    return NULL;
+  }
+  if (free_space < 48 && (!grow || grow_pool() != 0)) {
     return NULL;
   }
 
@@ -84,21 +131,64 @@ void* Mem_Alloc(int size) {
  
   // Give the user the first block in the free list 
   user_ptr = (char*) head;
+  debug_check_poison(head + 1, BLOCKSIZE - sizeof(block_header));
   head = head->next; 
   free_space -= BLOCKSIZE;
+  stats.allocs++;
+  if (grow) {
+    chunk_find(user_ptr)->used++;
+  }
   
   return user_ptr;
 }
 
-int Mem_Free(void *ptr) {   
+// Blocks are carved on 16-byte boundaries, so that is as far as this goes
+void* Mem_AllocAligned(int size, int align) {
+  if (align > BLOCKSIZE) {
+    return NULL;
+  }
+  return Mem_Alloc(size);
+}
+
+// Every block is the same size, so this is just Mem_Alloc() plus a clear
+void* Mem_Calloc(int count, int size) {
+  void* user_ptr;
+
+  if (count <= 0 || size <= 0 || count > BLOCKSIZE / size) {
+    return NULL;
+  }
+  user_ptr = Mem_Alloc(count * size);
+  if (user_ptr != NULL) {
+    memset(user_ptr, 0, BLOCKSIZE);
+  }
+  return user_ptr;
+}
+
+// Blocks can't change size, so the only size that works is the one they have
+void* Mem_Realloc(void* ptr, int size) {
+  if (ptr == NULL) {
+    return Mem_Alloc(size);
+  }
+  if (size <= 0) {
+    Mem_Free(ptr);
+    return NULL;
+  }
+  if (size != BLOCKSIZE) {
+    return NULL;
+  }
+  return ptr;
+}
+
+int free_block(void *ptr) {   
   
   if (ptr == NULL) {
     return -1;
   }
 
   // Ensure pointer points to something that was alloacted by Mem_Alloc()
-  if ((char*)ptr < start && (char*)ptr > end) {
-    return -1; // ptr was not in the address space given by Mem_Init()
+  chunk* c = chunk_find(ptr);
+  if (c == NULL) {
+    return -1; // ptr was not in the address space of the heap
   }
   if ((uintptr_t) ptr % BLOCKSIZE) { 
     return -1; // ptr did not point to the beginning of a block 
@@ -112,6 +202,7 @@ int Mem_Free(void *ptr) {
   }
 
   // Add this block to the front of the free list
+  debug_poison(ptr, BLOCKSIZE);
   block_header* new_free_block = (block_header*) ptr;
   new_free_block->next = head;
   head = new_free_block; 
@@ -119,10 +210,34 @@ int Mem_Free(void *ptr) {
   // Mark this block as free 
   ptr = NULL;
   free_space += BLOCKSIZE;
+  stats.frees++;
+
+  if (grow && --c->used == 0 && chunk_should_unmap(c, free_space)) {
+    release_chunk(c);
+  }
  
   return 0;
 }
 
+void* Mem_Alloc(int size) {
+  return TIME_CALL(stats.alloc_cycles, alloc_block(size));
+}
+
+int Mem_Free(void *ptr) {
+  return TIME_CALL(stats.free_cycles, free_block(ptr));
+}
+
+// Every block holds BLOCKSIZE bytes. This only checks that ptr is in the
+// heap and on a block boundary, not that the block is in use.
+int Mem_UsableSize(void* ptr) {
+  chunk* c = chunk_find(ptr);
+
+  if (c == NULL || ((char*) ptr - c->start) % BLOCKSIZE) {
+    return -1;
+  }
+  return BLOCKSIZE;
+}
+
 int Mem_Available() {
   return free_space;
 }
@@ -146,3 +261,43 @@ void Mem_Dump() {
   printf("%p -> %p\n", start, end);
   return;
 }
+
+void Mem_Stats(struct mem_stats* out) {
+  *out = stats;
+  out->in_use = num_blocks * BLOCKSIZE - free_space;
+  out->free = free_space;
+  out->free_blocks = free_space / BLOCKSIZE;
+  out->largest_free = free_space > 0 ? BLOCKSIZE : 0;
+  out->size_hist[stats_bucket(BLOCKSIZE)] = stats.allocs;
+  out->free_hist[stats_bucket(BLOCKSIZE)] = out->free_blocks;
+  out->fragmentation = 0; // every free block fits every request
+}
+
+// Walk the free list and check that every entry is a block in the heap and
+// that there are as many as free_space says. Returns 0 if all is well, or
+// reports the first problem on stderr and returns -1.
+int Mem_Check() {
+  block_header* curr = head;
+  chunk* c;
+  int count = 0;
+
+  while (curr != NULL) {
+    c = chunk_find(curr);
+    if (c == NULL || ((char*) curr - c->start) % BLOCKSIZE) {
+      return check_failed("free list entry isn't a block", curr);
+    }
+#ifdef MEM_DEBUG
+    if (debug_unpoisoned(curr + 1, BLOCKSIZE - sizeof(block_header)) != NULL) {
+      return check_failed("write after free", curr);
+    }
+#endif
+    if (++count > num_blocks) {
+      return check_failed("free list has a loop", curr);
+    }
+    curr = curr->next;
+  }
+  if (count * BLOCKSIZE != free_space) {
+    return check_failed("free_space doesn't match the free list", head);
+  }
+  return 0;
+}
@@ -10,25 +10,1091 @@
 #include <fcntl.h>
 #include <sys/mman.h>
 #include <string.h>
+#include <limits.h>
+#include <stdint.h>
 #include "mem.h"
+#include "chunk.h"
+#include "stats.h"
+#include "debug.h"
 
+// The blocks of a chunk follow one another from its start to its end, so
+// the next one is found from the size, and the one before from prev_size.
 typedef struct block_header{
   int size; // this is the size of the allocated area, excluding the header
-  int in_use; // true if this block is not free 
-  int wasted; // to ensure 8-byte alignment 
-  struct block_header* next;
+  short in_use; // true if this block is not free, QUICKLISTED if it is cached
+  short last; // true if this block ends its chunk
+  int prev_size; // size of the block right before it, or 0 if it starts its chunk
+  int canary; // CANARY ^ the header's address, so a pointer can be checked from its header
+#ifdef MEM_DEBUG
+  struct block_header* next; // guarded blocks only, which aren't in a chunk
+#endif
 
-}block_header;
+}__attribute__((aligned(16))) block_header; // so every area is 16-byte aligned
 
-block_header* head = NULL;
+#define MIN_FREE 16   // the smallest block, which has room for the bin links
+#define TREE_MIN 512  // free blocks this big go in the tree, smaller ones in bins
+#define ALIGN 16     // every block size is a multiple of this, like the header's
+#define NUM_BINS ((TREE_MIN - MIN_FREE) / ALIGN)
+#define QUICK_MAX 256         // freed blocks up to this big go on quick lists
+#define NUM_QUICK ((QUICK_MAX - MIN_FREE) / ALIGN + 1)
+#define QUICK_LIMIT 4096      // quick listed bytes before they are merged
+#define QUICKLISTED 2         // in_use for a block that is on a quick list
+#define RUN 4                 // in_use for a block that holds a run of small objects
+#define RUN_SIZE 4096         // how much of a page a run takes
+#define SMALL_MAX 128         // requests up to this big are small objects
+#define NUM_CLASSES (SMALL_MAX / 16)
+#define RUN_MAGIC 0x72756e5f6d656d33ULL
+#define CANARY 0x5ca1ab1e
+
+#ifdef MEM_DEBUG
+#define QUARANTINED 3         // in_use for a freed block that can't be reused yet
+#define QUARANTINE_SIZE 64    // how many freed blocks are held back
+#define RED_ZONE 16           // poisoned bytes after each object in a run
+#else
+#define RED_ZONE 0
+#endif
+
+// Free blocks are also indexed by size, with the links kept at the start
+// of their area. Small ones are on a list per size (bins), so a small
+// request takes the first block from the first non-empty bin that fits.
+typedef struct bin_node {
+  struct bin_node* next;
+  struct bin_node* prev;
+} bin_node;
+
+// Big ones are in a red-black tree ordered by size and then by address,
+// so the best fit is the leftmost block that is big enough
+typedef struct tree_node {
+  struct tree_node* left;
+  struct tree_node* right;
+  struct tree_node* parent;
+  int red;
+  int zeroed; // bytes at the end of the area still zero from mmap()
+} tree_node;
+
+// Small objects have no header. They are rounded up to a multiple of 16 and
+// come from a run: a page-aligned block cut into objects of one size, with
+// a bit per object at the start of the page saying whether it is handed out.
+// Freeing one rounds the pointer down to the page to find its run.
+typedef struct run_header {
+  unsigned long long magic; // RUN_MAGIC ^ the run's address
+  struct run_header* next;  // runs of the same size with objects free
+  struct run_header* prev;
+  int object_size;
+  int free;                 // objects not handed out
+  unsigned long long used[RUN_SIZE / 16 / 64]; // bit i is set if object i is handed out
+} run_header;
+
+int initialized = 0;
+int grow = 0;            // true if more chunks are mapped when the heap fills
+struct mem_stats stats;  // kept up to date on every call, see Mem_Stats()
+bin_node* bins[NUM_BINS];
+unsigned long long bin_map = 0; // bit i is set if bins[i] isn't empty
+tree_node* root = NULL;
+run_header* runs[NUM_CLASSES]; // runs with objects free, by object size
+int run_count = 0;
+
+// Freed small blocks are put on a quick list for their size instead, still
+// marked as not free so that nothing merges with them, and handed straight
+// back out to the next request of that size. consolidate() merges them all
+// into the free blocks once too much has piled up, or when a request can't
+// be met without them. They count as free in the stats.
+bin_node* quick[NUM_QUICK];  // only next is used
+unsigned int quick_map = 0;  // bit i is set if quick[i] isn't empty
+long quick_bytes = 0;
+
+int canary_of(block_header* b) {
+  return CANARY ^ (int) (uintptr_t) b;
+}
+
+void set_canary(block_header* b) {
+  b->canary = canary_of(b);
+}
+
+#ifdef MEM_DEBUG
+// Debug builds hold freed blocks back, filled with POISON, until
+// QUARANTINE_SIZE more have been freed, and check nothing wrote to them in
+// the meantime. Small objects aren't held back, but each one is followed by
+// RED_ZONE poisoned bytes that are checked when it is freed. With MEM_GUARD,
+// blocks of a page or more get a mapping of their own and end right where an
+// inaccessible page starts.
+block_header* quarantine[QUARANTINE_SIZE];
+int quarantine_next = 0;     // the oldest, which is the next to go
+int guard = 0;
+block_header* guarded_head = NULL;
+
+void check_canary(block_header* b) {
+  if (b->canary != canary_of(b)) {
+    debug_fail("block header overwritten", b);
+  }
+}
+#else
+#define check_canary(b) ((void) 0)
+#endif
+
+block_header* header_of(void* area) {
+  return (block_header*) ((char*) area - (int)sizeof(block_header));
+}
+
+// The block right after b in its chunk, or NULL if b ends the chunk
+block_header* block_after(block_header* b) {
+  if (b->last) {
+    return NULL;
+  }
+  return (block_header*) ((char*) b + (int)sizeof(block_header) + b->size);
+}
+
+// The block right before b in its chunk, or NULL if b starts the chunk
+block_header* block_before(block_header* b) {
+  if (b->prev_size == 0) {
+    return NULL;
+  }
+  return (block_header*) ((char*) b - (int)sizeof(block_header) - b->prev_size);
+}
+
+// Give block b size bytes, and tell the block after it
+void set_size(block_header* b, int size) {
+  b->size = size;
+  if (!b->last) {
+    block_after(b)->prev_size = size;
+  }
+}
+
+// Set up a new block at b of size bytes, right after a block of prev_size
+// bytes (0 if none), that ends its chunk if last is true
+void make_block(block_header* b, int size, int prev_size, int last, int in_use) {
+  b->in_use = in_use;
+  b->last = last;
+  b->prev_size = prev_size;
+  set_canary(b);
+  set_size(b, size);
+}
+
+int bin_index(int size) {
+  return (size - MIN_FREE) / ALIGN;
+}
+
+// True if a comes before b in the tree
+int tree_less(tree_node* a, tree_node* b) {
+  int a_size = header_of(a)->size;
+  int b_size = header_of(b)->size;
+
+  return a_size < b_size || (a_size == b_size && a < b);
+}
+
+void rotate_left(tree_node* x) {
+  tree_node* y = x->right;
+
+  x->right = y->left;
+  if (y->left != NULL) {
+    y->left->parent = x;
+  }
+  y->parent = x->parent;
+  if (x->parent == NULL) {
+    root = y;
+  } else if (x == x->parent->left) {
+    x->parent->left = y;
+  } else {
+    x->parent->right = y;
+  }
+  y->left = x;
+  x->parent = y;
+}
+
+void rotate_right(tree_node* x) {
+  tree_node* y = x->left;
+
+  x->left = y->right;
+  if (y->right != NULL) {
+    y->right->parent = x;
+  }
+  y->parent = x->parent;
+  if (x->parent == NULL) {
+    root = y;
+  } else if (x == x->parent->right) {
+    x->parent->right = y;
+  } else {
+    x->parent->left = y;
+  }
+  y->right = x;
+  x->parent = y;
+}
+
+void tree_insert(tree_node* n) {
+  tree_node** link = &root;
+  tree_node* parent = NULL;
+  tree_node* uncle;
+
+  while (*link != NULL) {
+    parent = *link;
+    link = tree_less(n, parent) ? &parent->left : &parent->right;
+  }
+  n->left = NULL;
+  n->right = NULL;
+  n->parent = parent;
+  n->red = 1;
+  *link = n;
+
+  // Fix up two reds in a row, going up the tree
+  while (n != root && n->parent->red) {
+    parent = n->parent;
+    if (parent == parent->parent->left) {
+      uncle = parent->parent->right;
+      if (uncle != NULL && uncle->red) {
+        parent->red = 0;
+        uncle->red = 0;
+        parent->parent->red = 1;
+        n = parent->parent;
+      } else {
+        if (n == parent->right) {
+          n = parent;
+          rotate_left(n);
+          parent = n->parent;
+        }
+        parent->red = 0;
+        parent->parent->red = 1;
+        rotate_right(parent->parent);
+      }
+    } else {
+      uncle = parent->parent->left;
+      if (uncle != NULL && uncle->red) {
+        parent->red = 0;
+        uncle->red = 0;
+        parent->parent->red = 1;
+        n = parent->parent;
+      } else {
+        if (n == parent->left) {
+          n = parent;
+          rotate_right(n);
+          parent = n->parent;
+        }
+        parent->red = 0;
+        parent->parent->red = 1;
+        rotate_left(parent->parent);
+      }
+    }
+  }
+  root->red = 0;
+}
+
+// Put v where u is in the tree
+void transplant(tree_node* u, tree_node* v) {
+  if (u->parent == NULL) {
+    root = v;
+  } else if (u == u->parent->left) {
+    u->parent->left = v;
+  } else {
+    u->parent->right = v;
+  }
+  if (v != NULL) {
+    v->parent = u->parent;
+  }
+}
+
+int is_red(tree_node* n) {
+  return n != NULL && n->red;
+}
+
+// Fix up the missing black at x (which may be NULL) below parent
+void remove_fixup(tree_node* x, tree_node* parent) {
+  tree_node* sibling;
+
+  while (x != root && !is_red(x)) {
+    if (x == parent->left) {
+      sibling = parent->right;
+      if (sibling->red) {
+        sibling->red = 0;
+        parent->red = 1;
+        rotate_left(parent);
+        sibling = parent->right;
+      }
+      if (!is_red(sibling->left) && !is_red(sibling->right)) {
+        sibling->red = 1;
+        x = parent;
+        parent = x->parent;
+      } else {
+        if (!is_red(sibling->right)) {
+          sibling->left->red = 0;
+          sibling->red = 1;
+          rotate_right(sibling);
+          sibling = parent->right;
+        }
+        sibling->red = parent->red;
+        parent->red = 0;
+        sibling->right->red = 0;
+        rotate_left(parent);
+        x = root;
+      }
+    } else {
+      sibling = parent->left;
+      if (sibling->red) {
+        sibling->red = 0;
+        parent->red = 1;
+        rotate_right(parent);
+        sibling = parent->left;
+      }
+      if (!is_red(sibling->left) && !is_red(sibling->right)) {
+        sibling->red = 1;
+        x = parent;
+        parent = x->parent;
+      } else {
+        if (!is_red(sibling->left)) {
+          sibling->right->red = 0;
+          sibling->red = 1;
+          rotate_left(sibling);
+          sibling = parent->left;
+        }
+        sibling->red = parent->red;
+        parent->red = 0;
+        sibling->left->red = 0;
+        rotate_right(parent);
+        x = root;
+      }
+    }
+  }
+  if (x != NULL) {
+    x->red = 0;
+  }
+}
+
+void tree_remove(tree_node* n) {
+  tree_node* y = n; // the node that really leaves its place
+  tree_node* x;     // what takes y's place
+  tree_node* x_parent;
+  int removed_red = n->red;
+
+  if (n->left == NULL) {
+    x = n->right;
+    x_parent = n->parent;
+    transplant(n, n->right);
+  } else if (n->right == NULL) {
+    x = n->left;
+    x_parent = n->parent;
+    transplant(n, n->left);
+  } else {
+    // Two children, so n's successor takes its place
+    y = n->right;
+    while (y->left != NULL) {
+      y = y->left;
+    }
+    removed_red = y->red;
+    x = y->right;
+    if (y->parent == n) {
+      x_parent = y;
+    } else {
+      x_parent = y->parent;
+      transplant(y, y->right);
+      y->right = n->right;
+      y->right->parent = y;
+    }
+    transplant(n, y);
+    y->left = n->left;
+    y->left->parent = y;
+    y->red = n->red;
+  }
+  if (!removed_red) {
+    remove_fixup(x, x_parent);
+  }
+}
+
+// The smallest free block in the tree with at least size bytes, the lowest
+// one in memory if there are several
+block_header* tree_best_fit(int size) {
+  tree_node* n = root;
+  tree_node* best = NULL;
+
+  while (n != NULL) {
+    if (header_of(n)->size >= size) {
+      best = n;
+      n = n->left;
+    } else {
+      n = n->right;
+    }
+  }
+  return best == NULL ? NULL : header_of(best);
+}
+
+// How many bytes at the start of free block b's area its links take
+int free_links(block_header* b) {
+  return b->size >= TREE_MIN ? (int)sizeof(tree_node) : (int)sizeof(bin_node);
+}
+
+// How many bytes at the end of free block b's area are still zero from
+// mmap(). Only blocks in the tree keep track. The tree node is left alone
+// when b leaves the free blocks, so this still works right after that.
+int block_zeroed(block_header* b) {
+  tree_node* n = (tree_node*) ((char*) b + (int)sizeof(block_header));
+
+  return b->size >= TREE_MIN ? n->zeroed : 0;
+}
+
+// Bookkeeping for block b joining the free blocks. zeroed is how many bytes
+// at the end of its area are known to still be zero.
+void free_add(block_header* b, int zeroed) {
+  bin_node* node = (bin_node*) ((char*) b + (int)sizeof(block_header));
+  int links = free_links(b);
+  int i;
+
+  stats.free += b->size;
+  stats.free_blocks++;
+  stats.free_hist[stats_bucket(b->size)]++;
+
+  // The links go over the start of the area, which isn't zero any more
+  if (b->size < TREE_MIN) {
+    zeroed = 0;
+  } else if (zeroed > b->size - links) {
+    zeroed = b->size - links;
+  }
+  debug_poison((char*) node + links, b->size - links - zeroed);
+  if (b->size >= TREE_MIN) {
+    ((tree_node*) node)->zeroed = zeroed;
+    tree_insert((tree_node*) node);
+    return;
+  }
+  i = bin_index(b->size);
+  node->prev = NULL;
+  node->next = bins[i];
+  if (node->next != NULL) {
+    node->next->prev = node;
+  }
+  bins[i] = node;
+  bin_map |= 1ULL << i;
+}
+
+// Bookkeeping for block b leaving the free blocks
+void free_remove(block_header* b) {
+  bin_node* node = (bin_node*) ((char*) b + (int)sizeof(block_header));
+  int i;
+
+  debug_check_poison((char*) node + free_links(b), b->size - free_links(b) - block_zeroed(b));
+  stats.free -= b->size;
+  stats.free_blocks--;
+  stats.free_hist[stats_bucket(b->size)]--;
+
+  if (b->size >= TREE_MIN) {
+    tree_remove((tree_node*) node);
+    return;
+  }
+  i = bin_index(b->size);
+  if (node->prev != NULL) {
+    node->prev->next = node->next;
+  } else {
+    bins[i] = node->next;
+    if (bins[i] == NULL) {
+      bin_map &= ~(1ULL << i);
+    }
+  }
+  if (node->next != NULL) {
+    node->next->prev = node->prev;
+  }
+}
+
+void quick_push(block_header* b) {
+  bin_node* node = (bin_node*) ((char*) b + (int)sizeof(block_header));
+  int i = bin_index(b->size);
+
+  b->in_use = QUICKLISTED;
+  node->next = quick[i];
+  quick[i] = node;
+  quick_map |= 1U << i;
+  quick_bytes += b->size;
+  stats.free += b->size;
+  stats.free_blocks++;
+  stats.free_hist[stats_bucket(b->size)]++;
+}
+
+// Take the block that *link points to off quick list i
+block_header* quick_unlink(int i, bin_node** link) {
+  block_header* b = header_of(*link);
+
+  debug_check_poison((char*) *link + sizeof(bin_node*), b->size - sizeof(bin_node*));
+  *link = (*link)->next;
+  if (quick[i] == NULL) {
+    quick_map &= ~(1U << i);
+  }
+  b->in_use = 1;
+  quick_bytes -= b->size;
+  stats.free -= b->size;
+  stats.free_blocks--;
+  stats.free_hist[stats_bucket(b->size)]--;
+  return b;
+}
+
+// Take a block of exactly size bytes off its quick list, if there is one
+block_header* quick_pop(int size) {
+  int i = bin_index(size);
+
+  if (size > QUICK_MAX || quick[i] == NULL) {
+    return NULL;
+  }
+  return quick_unlink(i, &quick[i]);
+}
+
+// The same, but the block's area has to be aligned to align. The quick
+// lists are short (see QUICK_LIMIT), so this looks through the whole one.
+block_header* quick_pop_aligned(int size, int align) {
+  bin_node** link;
+  int i = bin_index(size);
+
+  if (size > QUICK_MAX) {
+    return NULL;
+  }
+  for (link = &quick[i]; *link != NULL; link = &(*link)->next) {
+    if ((uintptr_t) *link % align == 0) {
+      return quick_unlink(i, link);
+    }
+  }
+  return NULL;
+}
+
+// Bookkeeping for block b being handed out
+void count_alloc(block_header* b) {
+  stats.in_use += b->size;
+  stats.allocs++;
+  stats.size_hist[stats_bucket(b->size)]++;
+}
+
+// Round size up so that the next block stays 16-byte aligned, as malloc()
+// promises, and so the block can hold the bin links once it is freed
+int round_size(int size) {
+  int extra_bytes;
+
+  if (size < MIN_FREE) {
+    return MIN_FREE;
+  }
+  extra_bytes = size % ALIGN;
+  extra_bytes = (ALIGN - extra_bytes) % ALIGN;
+  return size + extra_bytes; 
+}
+
+// Cut the block in use curr_node back to rounded_size bytes and turn the
+// rest into a free block, if there is room for one. zeroed is how many bytes
+// at the end of the part cut off are known to still be zero.
+void trim_block(block_header* curr_node, int rounded_size, int zeroed) {
+  block_header* new_block = NULL; // the result of a split
+  block_header* next_block = block_after(curr_node);
+  int new_size = curr_node->size - rounded_size - (int)sizeof(block_header);
+
+  if (new_size < MIN_FREE) {
+    return; // too small to be a block of its own
+  }
+  new_block = (block_header*) ((char*) curr_node + (int)sizeof(block_header) + rounded_size);
+  make_block(new_block, new_size, rounded_size, curr_node->last, 0);
+  curr_node->size = rounded_size;
+  curr_node->last = 0;
+
+  // Coalesce with the block after it, which can only be free after a realloc
+  if (next_block != NULL && !(next_block->in_use)) {
+    free_remove(next_block);
+    new_block->last = next_block->last;
+    set_size(new_block, new_size + next_block->size + (int)sizeof(block_header));
+    zeroed = block_zeroed(next_block);
+  }
+  free_add(new_block, zeroed);
+}
+
+// Hand out the free block curr_node for rounded_size bytes, splitting the
+// rest off into a new free block if there is room for one
+void* use_block(block_header* curr_node, int rounded_size) {
+  curr_node->in_use = 1;
+  free_remove(curr_node);
+  trim_block(curr_node, rounded_size, block_zeroed(curr_node));
+  count_alloc(curr_node);
+  return (char*) curr_node + (int)sizeof(block_header);
+}
+
+// Map a chunk with room for rounded_size bytes, as a single free block
+block_header* grow_heap(int rounded_size) {
+  chunk* c;
+  block_header* new_block;
+
+  c = chunk_map(chunk_grow_size(rounded_size + 2 * sizeof(block_header) + MIN_FREE));
+  if (c == NULL) {
+    return NULL;
+  }
+  new_block = (block_header*) c->start;
+  make_block(new_block, (c->end - c->start) - (int)sizeof(block_header), 0, 1, 0);
+  free_add(new_block, new_block->size);
+  return new_block;
+}
+
+// Where an area of rounded_size bytes aligned to align could start in the
+// free block curr_node, or NULL if it doesn't fit. A gap in front of the
+// area has to be big enough to become a free block of its own, unless the
+// block before is right next to it and can take it. A quick listed block
+// can't, since it has to stay the size of its list.
+char* aligned_start(block_header* curr_node, int rounded_size, int align) {
+  char* area = (char*) curr_node + (int)sizeof(block_header);
+  char* aligned = (char*) (((uintptr_t) area + align - 1) & ~((uintptr_t) align - 1));
+  block_header* prev = block_before(curr_node);
+  int prev_takes_gap = prev != NULL && prev->in_use != QUICKLISTED;
+
+  while (aligned != area && aligned - area < (int)sizeof(block_header) + MIN_FREE && !prev_takes_gap) {
+    aligned += align;
+  }
+  if (aligned + rounded_size > area + curr_node->size) {
+    return NULL;
+  }
+  return aligned;
+}
+
+// Hand out the part of the free block curr_node that starts at aligned
+// (from aligned_start()). The gap in front of it goes back into the free
+// list, or to the block before if it is too small for that.
+void* use_aligned(block_header* curr_node, char* aligned, int rounded_size) {
+  block_header* prev = block_before(curr_node);
+  char* area = (char*) curr_node + (int)sizeof(block_header);
+  char* end = area + curr_node->size;
+  int zeroed = block_zeroed(curr_node);
+  char* zero_from = end - zeroed;
+  char* gap_end = aligned - (int)sizeof(block_header);
+  int last = curr_node->last;
+  block_header* new_block = (block_header*) gap_end;
+
+  if (aligned == area) {
+    return use_block(curr_node, rounded_size);
+  }
+  free_remove(curr_node);
+
+  if (aligned - area < (int)sizeof(block_header) + MIN_FREE) {
+    // Too small to be a block, so the block before grows over it
+    if (prev->in_use) {
+      debug_poison(curr_node, aligned - area); // in case prev is in quarantine
+      prev->size += aligned - area;
+      if (prev->in_use != RUN) {
+        stats.in_use += aligned - area;
+      }
+    } else {
+      free_remove(prev);
+      prev->size += aligned - area;
+      free_add(prev, 0);
+    }
+    make_block(new_block, end - aligned, prev->size, last, 1);
+  } else {
+    // Split the gap off as a free block
+    curr_node->size = gap_end - area;
+    curr_node->last = 0;
+    free_add(curr_node, zero_from < gap_end ? gap_end - (zero_from > area ? zero_from : area) : 0);
+    make_block(new_block, end - aligned, curr_node->size, last, 1);
+  }
+
+  trim_block(new_block, rounded_size, zeroed);
+  count_alloc(new_block);
+  return aligned;
+}
+
+// The block in use that ptr was handed out from, or NULL if there is none.
+// Only the header in front of ptr is looked at: it has to be in the heap,
+// and have the right canary and be in use.
+block_header* find_in_use(void* ptr) {
+  block_header* ptr_block = header_of(ptr);
+  chunk* c;
+#ifdef MEM_DEBUG
+  block_header* curr_node;
+#endif
+
+  if ((uintptr_t) ptr % ALIGN == 0) {
+    c = chunk_find(ptr_block);
+    if (c != NULL && (char*) ptr <= c->end && ptr_block->canary == canary_of(ptr_block) &&
+        ptr_block->in_use == 1) {
+      return ptr_block; // pointer was indeed initialized by Mem_Alloc()
+    }
+  }
+#ifdef MEM_DEBUG
+  for (curr_node = guarded_head; curr_node != NULL; curr_node = curr_node->next) {
+    check_canary(curr_node);
+    if (ptr_block == curr_node) {
+      return curr_node;
+    }
+  }
+#endif
+  return NULL;
+}
+
+// Unmap the chunk that free block b belongs to if b now covers all of it
+void release_chunk(block_header* b) {
+  chunk* c;
+
+  if (b->prev_size != 0 || !b->last) {
+    return; // the chunk still has blocks in use
+  }
+  c = chunk_find(b);
+  if (chunk_should_unmap(c, stats.free)) {
+    free_remove(b);
+    chunk_unmap(c);
+  }
+}
+
+// Mark the block free_node free and merge it with the free blocks on
+// either side. Returns the free block that free_node ends up in.
+block_header* merge_free(block_header* free_node) {
+  block_header* next_block = block_after(free_node);
+  block_header* prev_block = block_before(free_node);
+  int zeroed = 0;
+
+  free_node->in_use = 0;
+
+  if (next_block != NULL && !(next_block->in_use)) {
+    check_canary(next_block);
+    free_remove(next_block);
+    free_node->last = next_block->last;
+    set_size(free_node, free_node->size + next_block->size + (int)sizeof(block_header));
+    zeroed = block_zeroed(next_block);
+  }
+  if (prev_block != NULL && !(prev_block->in_use)) {
+    check_canary(prev_block);
+    free_remove(prev_block);
+    prev_block->last = free_node->last;
+    set_size(prev_block, prev_block->size + free_node->size + (int)sizeof(block_header));
+    free_add(prev_block, zeroed);
+    return prev_block;
+  }
+  free_add(free_node, zeroed);
+  return free_node;
+}
+
+// Merge every quick listed block into the free blocks, going through the
+// quick lists rather than the whole heap, and give back any chunk that is
+// left with nothing in use
+void consolidate() {
+  bin_node* lists[NUM_QUICK];
+  bin_node* node = NULL;
+  bin_node* next_node = NULL;
+  block_header* b = NULL;
+  int i;
+
+  memcpy(lists, quick, sizeof(quick));
+  memset(quick, 0, sizeof(quick));
+  quick_map = 0;
+  quick_bytes = 0;
+
+  for (i = 0; i < NUM_QUICK; i++) {
+    for (node = lists[i]; node != NULL; node = next_node) {
+      next_node = node->next; // merging writes over the links
+      b = header_of(node);
+      debug_check_poison((char*) node + sizeof(bin_node*), b->size - sizeof(bin_node*));
+      stats.free -= b->size;
+      stats.free_blocks--;
+      stats.free_hist[stats_bucket(b->size)]--;
+      b = merge_free(b);
+      if (grow) {
+        release_chunk(b);
+      }
+    }
+  }
+}
+
+// Give the block free_node, which was in use, back to the free blocks
+void release_block(block_header* free_node) {
+  block_header* merged = NULL; // The free block it ends up in
+
+  stats.in_use -= free_node->size;
+
+  // Small blocks are cached, and only merged when too many pile up
+  if (free_node->size <= QUICK_MAX) {
+    quick_push(free_node);
+    if (quick_bytes > QUICK_LIMIT) {
+      consolidate();
+    }
+    return;
+  }
+
+  // Coalesce with the blocks on either side, which the list links give
+  merged = merge_free(free_node);
+
+  // Give back the chunk if this was the last block in use there
+  if (grow) {
+    release_chunk(merged);
+  }
+}
+
+#ifdef MEM_DEBUG
+// Let every block in quarantine be reused
+void flush_quarantine() {
+  block_header* b;
+  int i;
+
+  for (i = 0; i < QUARANTINE_SIZE; i++) {
+    b = quarantine[i];
+    if (b != NULL) {
+      quarantine[i] = NULL;
+      debug_check_poison((char*) b + sizeof(block_header), b->size);
+      release_block(b);
+    }
+  }
+}
+
+// Guarded blocks are the only ones that aren't in a chunk
+int is_guarded(block_header* b) {
+  return chunk_find(b) == NULL;
+}
+
+// How much is mapped for a guarded block of size bytes, guard page included
+long guard_map_size(int size) {
+  long pagesize = getpagesize();
+
+  return ((long) sizeof(block_header) + size + pagesize - 1) / pagesize * pagesize + pagesize;
+}
+
+void* alloc_guarded(int rounded_size) {
+  long map_size = guard_map_size(rounded_size);
+  char* guard_page;
+  block_header* b;
+
+  // Not from chunk_map_region(), which may hand out huge pages, because the
+  // guard page has to be protected on its own
+  char* map_ptr = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (map_ptr == MAP_FAILED) {
+    return NULL;
+  }
+  guard_page = map_ptr + map_size - getpagesize();
+  mprotect(guard_page, getpagesize(), PROT_NONE);
+
+  b = (block_header*) (guard_page - rounded_size - sizeof(block_header));
+  b->size = rounded_size;
+  b->in_use = 1;
+  b->last = 1;
+  b->prev_size = 0;
+  b->next = guarded_head;
+  set_canary(b);
+  guarded_head = b;
+  count_alloc(b);
+  return guard_page - rounded_size;
+}
+
+void free_guarded(block_header* b) {
+  block_header** link = &guarded_head;
+  char* guard_page = (char*) b + sizeof(block_header) + b->size;
+  long map_size = guard_map_size(b->size);
+
+  while (*link != b) {
+    link = &(*link)->next;
+  }
+  *link = b->next;
+  stats.in_use -= b->size;
+  munmap(guard_page + getpagesize() - map_size, map_size);
+}
+#endif
+
+// How far apart the objects in run r are
+int run_stride(run_header* r) {
+  return r->object_size + RED_ZONE;
+}
+
+int run_objects(run_header* r) {
+  return (RUN_SIZE - (int)sizeof(run_header)) / run_stride(r);
+}
+
+char* run_object(run_header* r, int i) {
+  return (char*) r + (int)sizeof(run_header) + i * run_stride(r);
+}
+
+// Put run r on the list for its size, because it has objects free
+void run_link(run_header* r) {
+  run_header** list = &runs[r->object_size / 16 - 1];
+
+  r->prev = NULL;
+  r->next = *list;
+  if (r->next != NULL) {
+    r->next->prev = r;
+  }
+  *list = r;
+}
+
+void run_unlink(run_header* r) {
+  if (r->prev != NULL) {
+    r->prev->next = r->next;
+  } else {
+    runs[r->object_size / 16 - 1] = r->next;
+  }
+  if (r->next != NULL) {
+    r->next->prev = r->prev;
+  }
+}
+
+// The run that ptr points into, or NULL if it isn't in one. Only the page
+// that ptr is on is looked at, so this is safe for any pointer in the heap.
+run_header* run_of(void* ptr) {
+  run_header* r = (run_header*) ((uintptr_t) ptr & ~((uintptr_t) RUN_SIZE - 1));
+  chunk* c;
+
+  if (run_count == 0) {
+    return NULL;
+  }
+  c = chunk_find(ptr);
+  if (c == NULL || (char*) r < c->start || (char*) r + sizeof(run_header) > c->end) {
+    return NULL;
+  }
+  return r->magic == (RUN_MAGIC ^ (uintptr_t) r) ? r : NULL;
+}
+
+// Which object of run r ptr is, or -1 if ptr isn't one that is handed out
+int run_index(run_header* r, void* ptr) {
+  long offset = (char*) ptr - run_object(r, 0);
+  int i;
+
+  if (offset < 0 || offset % run_stride(r)) {
+    return -1;
+  }
+  i = offset / run_stride(r);
+  if (i >= run_objects(r) || !((r->used[i / 64] >> (i % 64)) & 1)) {
+    return -1;
+  }
+  return i;
+}
+
+// Carve a run of objects of object_size bytes out of the heap, or return
+// NULL if there is no room for one
+run_header* new_run(int object_size) {
+  run_header* r = (run_header*) Mem_AllocAligned(RUN_SIZE, RUN_SIZE);
+  block_header* b;
+
+  if (r == NULL) {
+    return NULL;
+  }
+
+  // The block isn't something a caller asked for, and its objects count
+  // as free until they are handed out
+  b = header_of(r);
+  b->in_use = RUN;
+  stats.in_use -= b->size;
+  stats.allocs--;
+  stats.size_hist[stats_bucket(b->size)]--;
+
+  r->magic = RUN_MAGIC ^ (uintptr_t) r;
+  r->object_size = object_size;
+  r->free = run_objects(r);
+  memset(r->used, 0, sizeof(r->used));
+  debug_poison(run_object(r, 0), r->free * run_stride(r));
+  stats.free += (long) r->free * object_size;
+  stats.free_blocks += r->free;
+  stats.free_hist[stats_bucket(object_size)] += r->free;
+  run_link(r);
+  run_count++;
+  return r;
+}
+
+// Give run r, which has nothing handed out, back to the heap
+void release_run(run_header* r) {
+  block_header* b = header_of(r);
+
+  run_unlink(r);
+  run_count--;
+  stats.free -= (long) r->free * r->object_size;
+  stats.free_blocks -= r->free;
+  stats.free_hist[stats_bucket(r->object_size)] -= r->free;
+  r->magic = 0; // so that the page is never taken for a run again
+  b->in_use = 1;
+  stats.in_use += b->size; // release_block() takes it back off
+  release_block(b);
+}
+
+// Hand out an object of object_size bytes (a multiple of 16) from a run,
+// or return NULL if a new run was needed and there was no room for it
+void* alloc_small(int object_size) {
+  run_header* r = runs[object_size / 16 - 1];
+  char* ptr;
+  int i = 0;
+
+  if (r == NULL) {
+    r = new_run(object_size);
+    if (r == NULL) {
+      return NULL;
+    }
+  }
+  while (r->used[i / 64] == ~0ULL) {
+    i += 64;
+  }
+  i += __builtin_ctzll(~r->used[i / 64]);
+  r->used[i / 64] |= 1ULL << (i % 64);
+  if (--r->free == 0) {
+    run_unlink(r);
+  }
+
+  ptr = run_object(r, i);
+  debug_check_poison(ptr, object_size);
+  stats.free -= object_size;
+  stats.free_blocks--;
+  stats.free_hist[stats_bucket(object_size)]--;
+  stats.in_use += object_size;
+  stats.allocs++;
+  stats.size_hist[stats_bucket(object_size)]++;
+  return ptr;
+}
+
+// Give object i of run r back. A run left empty goes back to the heap,
+// unless it is the only one of its size with room.
+void free_small(run_header* r, int i) {
+#ifdef MEM_DEBUG
+  if (debug_unpoisoned(run_object(r, i) + r->object_size, RED_ZONE) != NULL) {
+    debug_fail("write past the end of an object", run_object(r, i));
+  }
+#endif
+  debug_poison(run_object(r, i), r->object_size);
+  r->used[i / 64] &= ~(1ULL << (i % 64));
+  stats.in_use -= r->object_size;
+  stats.free += r->object_size;
+  stats.free_blocks++;
+  stats.free_hist[stats_bucket(r->object_size)]++;
+  if (r->free++ == 0) {
+    run_link(r);
+  }
+  if (r->free == run_objects(r) && (r->prev != NULL || r->next != NULL)) {
+    release_run(r);
+  }
+}
+
+// The free block that best fits rounded_size bytes, or NULL if none does
+block_header* best_fit(int rounded_size) {
+  unsigned long long fits;
+  
+  // This implementation uses the best fit policy: the smallest bin that
+  // fits, and then the smallest block in the tree that does
+  if (rounded_size < TREE_MIN) {
+    fits = bin_map >> bin_index(rounded_size);
+    if (fits) {
+      return header_of(bins[bin_index(rounded_size) + __builtin_ctzll(fits)]);
+    }
+  }
+  return tree_best_fit(rounded_size);
+}
+
+// Find a free block with room for rounded_size bytes, mapping more memory
+// if the heap is allowed to grow. Returns NULL if there is none.
+block_header* find_block(int rounded_size) {
+  block_header* best = best_fit(rounded_size);
+
+#ifdef MEM_DEBUG
+  if (best == NULL) {
+    flush_quarantine();
+    best = best_fit(rounded_size);
+  }
+#endif
+
+  // The quick listed blocks may make one that fits once they are merged
+  if (best == NULL && quick_bytes > 0) {
+    consolidate();
+    best = best_fit(rounded_size);
+  }
+
+  // Nothing fits, so map more memory if we are allowed to
+  if (best == NULL && grow && initialized) {
+    best = grow_heap(rounded_size);
+  }
+  return best;
+}
 
 int Mem_Init(int size) {
+  return Mem_InitFlags(size, 0);
+}
+
+int Mem_InitFlags(int size, int flags) {
   static int already_called = 0; // this function can only be called once
   int pagesize;
   int extra_bytes;
   int total_size;
-  int fd;
-  void* init_ptr;
+  chunk* c;
+  block_header* b;
 
   if(already_called || size <= 0) {
     return -1;
@@ -42,176 +1108,590 @@ int Mem_Init(int size) {
 
   total_size = size + extra_bytes;
 
-  fd = open("/dev/zero", O_RDWR);
-  if(fd == -1) {
+  chunk_placement = flags & (MEM_HUGETLB | MEM_NUMA);
+  c = chunk_map(total_size);
+  if (c == NULL) {
     return -1;
   }
   
-  init_ptr = mmap(NULL, total_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
-  if (init_ptr == MAP_FAILED) {
-    return -1;
-  }
-  
-  head = (block_header*)init_ptr;
-  head->next = NULL;
-  head->size = total_size - (int)sizeof(block_header);
-  head->in_use = 0;
+  b = (block_header*)c->start;
+  make_block(b, total_size - (int)sizeof(block_header), 0, 1, 0);
+  free_add(b, b->size);
+  initialized = 1;
   
+  grow = flags & MEM_GROW;
+#ifdef MEM_DEBUG
+  guard = flags & MEM_GUARD;
+#endif
   already_called = 1; 
-  close(fd);
   return 0;
 }
 
-void* Mem_Alloc(int size) {
+void* alloc_block(int size) {
   block_header* curr_node = NULL;
-  block_header* new_block = NULL; // the result of a split
-  int orig_size;
-  int extra_bytes; 
   int rounded_size;
-  void* block_ptr; 
+  void* ptr;
   
-  if (size <= 0) { 
+  if (size <= 0 || size > INT_MAX - ALIGN) { 
     return NULL;
   }
+
+  // Small objects come from a run if there is room for one
+  if (size <= SMALL_MAX) {
+    ptr = alloc_small((size + 15) & ~15);
+    if (ptr != NULL) {
+      return ptr;
+    }
+  }
  
-  // Ensure the returned pointer is 8-byte aligned
-  extra_bytes = size % 8;
-  extra_bytes = (8 - extra_bytes) % 8;
-  rounded_size = size + extra_bytes; 
+  // Ensure the returned pointer is 16-byte aligned
+  rounded_size = round_size(size); 
+
+#ifdef MEM_DEBUG
+  if (guard && rounded_size >= getpagesize()) {
+    return alloc_guarded(rounded_size);
+  }
+#endif
+
+  curr_node = quick_pop(rounded_size);
+  if (curr_node != NULL) {
+    count_alloc(curr_node);
+    return (char*) curr_node + (int)sizeof(block_header);
+  }
   
-  // This implementation uses the first fit policy
-  curr_node = head;
-  while (curr_node != NULL) {
-      
-    if (curr_node->in_use || curr_node->size <= rounded_size) {
-      curr_node = curr_node->next;
-    } else { 
-
-      // This block is the first fit 
-      orig_size = curr_node->size;
-      curr_node->size = rounded_size;
-      curr_node->in_use = 1;
-      block_ptr = (char*) curr_node + (int)sizeof(block_header);
-        
-      // Split into two blocks if possible
-      if (orig_size - rounded_size >= (int)sizeof(block_header) + 8) {
-        new_block = (block_header*) ((char*) curr_node + (int)sizeof(block_header) + rounded_size);
-        new_block->size = orig_size - rounded_size - (int)sizeof(block_header);
-        new_block->in_use = 0;
-
-        if (curr_node->next != NULL) {
-          new_block->next = curr_node->next;
-        } else {
-          new_block->next = NULL;
-        }
-        curr_node->next = new_block;
-      } 
+  curr_node = find_block(rounded_size);
+  if (curr_node == NULL) {
+    return NULL;
+  }
+  return use_block(curr_node, rounded_size);
+}
+
+void* Mem_Alloc(int size) {
+  return TIME_CALL(stats.alloc_cycles, alloc_block(size));
+}
+
+void* Mem_AllocAligned(int size, int align) {
+  block_header* curr_node = NULL;
+  int rounded_size;
+  char* aligned = NULL;
+
+  if (align <= ALIGN) {
+    return Mem_Alloc(size); // every block is 16-byte aligned anyway
+  }
+  if (size <= 0 || size > INT_MAX - ALIGN || (align & (align - 1)) || align > getpagesize()) {
+    return NULL;
+  }
+  rounded_size = round_size(size);
+
+  // A quick listed block of that size may already be aligned
+  curr_node = quick_pop_aligned(rounded_size, align);
+  if (curr_node != NULL) {
+    count_alloc(curr_node);
+    return (char*) curr_node + (int)sizeof(block_header);
+  }
+
+  // The best fit may have room for the aligned area. If not, one that is
+  // big enough for the area and a free block in front of it always does.
+  curr_node = best_fit(rounded_size);
+  if (curr_node != NULL) {
+    aligned = aligned_start(curr_node, rounded_size, align);
+  }
+  if (aligned == NULL) {
+    curr_node = find_block(rounded_size + align + (int)sizeof(block_header) + MIN_FREE);
+    if (curr_node == NULL) {
+      return NULL;
+    }
+    aligned = aligned_start(curr_node, rounded_size, align);
+  }
+  return use_aligned(curr_node, aligned, rounded_size);
+}
+
+void* Mem_Calloc(int count, int size) {
+  block_header* curr_node = NULL;
+  int rounded_size;
+  int dirty; // bytes of the new area that may have been written before
+  void* block_ptr;
+
+  if (count <= 0 || size <= 0 || count > (INT_MAX - ALIGN) / size) {
+    return NULL;
+  }
+  size *= count;
+  rounded_size = round_size(size);
+
+  if (size <= SMALL_MAX) {
+    block_ptr = alloc_small((size + 15) & ~15);
+    if (block_ptr != NULL) {
+      memset(block_ptr, 0, size);
       return block_ptr;
     }
   }
-  return NULL;
+
+#ifdef MEM_DEBUG
+  if (guard && rounded_size >= getpagesize()) {
+    return alloc_guarded(rounded_size); // a new mapping, so already zero
+  }
+#endif
+
+  curr_node = quick_pop(rounded_size);
+  if (curr_node != NULL) {
+    count_alloc(curr_node);
+    block_ptr = (char*) curr_node + (int)sizeof(block_header);
+    memset(block_ptr, 0, size);
+    return block_ptr;
+  }
+
+  curr_node = find_block(rounded_size);
+  if (curr_node == NULL) {
+    return NULL;
+  }
+
+  // Only clear what may have been used since the memory was mapped, the
+  // rest still holds the zeroes that came from /dev/zero
+  dirty = curr_node->size - block_zeroed(curr_node);
+  block_ptr = use_block(curr_node, rounded_size);
+  memset(block_ptr, 0, dirty < size ? dirty : size);
+  return block_ptr;
 }
 
-int Mem_Free(void *ptr) {   
-  block_header* ptr_block = NULL; // The block that ptr supposedly points to 
-  block_header* free_node = NULL; // The block that ptr is indeed referencing 
+void* Mem_Realloc(void* ptr, int size) {
+  block_header* curr_node = NULL;
+  block_header* next_block = NULL;
+  run_header* r = NULL;
+  int rounded_size;
+  int old_size;
+  int zeroed = 0;
+  void* new_ptr;
 
-  // Used for coalescing
-  block_header* prev_block = NULL; // The block directly before the block being freed 
-  block_header* next_block = NULL; // The block directly after the block being freed 
-  int prev_free = 0; // True if the previous block is free 
-  int next_free = 0; // True if the next block is free
-  
   if (ptr == NULL) {
-    return -1;
+    return Mem_Alloc(size);
+  }
+  if (size <= 0) {
+    Mem_Free(ptr);
+    return NULL;
+  }
+  if (size > INT_MAX - ALIGN) {
+    return NULL;
   }
 
-  // Ensure pointer points to something that was alloacted by Mem_Alloc() 
-  free_node = head;
-  ptr_block = (block_header*) ((char*) ptr - (int)sizeof(block_header));
-  while (free_node != NULL) {
-    if (ptr_block == free_node && free_node->in_use) {
-      break; // pointer was indeed initialized by Mem_Alloc()
-    } else {
-      free_node = free_node->next;
-      if (free_node == NULL) {
-        return -1; // there is no block that ptr was pointing to
-      }
+  // A small object stays put while it fits, and moves otherwise
+  r = run_of(ptr);
+  if (r != NULL) {
+    if (run_index(r, ptr) < 0) {
+      return NULL;
+    }
+    if (size <= r->object_size) {
+      return ptr;
     }
-  } 
+    new_ptr = Mem_Alloc(size);
+    if (new_ptr != NULL) {
+      memcpy(new_ptr, ptr, r->object_size);
+      Mem_Free(ptr);
+    }
+    return new_ptr;
+  }
 
-  // Mark this block as free 
-  free_node->in_use = 0;
-  ptr = NULL;
- 
-  // Coalesce: First get the blocks adjacent to the freed block 
-  if (free_node == head) {
-    prev_block = NULL; // head has no previous block 
-  } else {
-    prev_block = head;
-    while (prev_block->next != free_node) {
-      prev_block = prev_block->next;
+  curr_node = find_in_use(ptr);
+  if (curr_node == NULL) {
+    return NULL; // ptr was not handed out by Mem_Alloc()
+  }
+  rounded_size = round_size(size);
+  old_size = curr_node->size;
+
+#ifdef MEM_DEBUG
+  // A guarded block always moves, so that it stays up against its guard page
+  if (is_guarded(curr_node)) {
+    new_ptr = Mem_Alloc(size);
+    if (new_ptr != NULL) {
+      memcpy(new_ptr, ptr, old_size < size ? old_size : size);
+      Mem_Free(ptr);
     }
-  }    
-  next_block = free_node->next; 
+    return new_ptr;
+  }
+#endif
 
-  // Check if adjacent blocks are free 
-  if (prev_block != NULL && !(prev_block->in_use)) {
-    prev_free = 1;
+  // Grow in place by taking over the free block right after this one
+  next_block = block_after(curr_node);
+  if (rounded_size > curr_node->size && next_block != NULL && !(next_block->in_use) &&
+      curr_node->size + (int)sizeof(block_header) + next_block->size >= rounded_size) {
+    free_remove(next_block);
+    curr_node->last = next_block->last;
+    set_size(curr_node, curr_node->size + next_block->size + (int)sizeof(block_header));
+    zeroed = block_zeroed(next_block);
   }
-  if (next_block != NULL && !(next_block->in_use)) {
-    next_free = 1;
+
+  if (rounded_size <= curr_node->size) {
+    trim_block(curr_node, rounded_size, zeroed);
+    stats.in_use += curr_node->size - old_size;
+    return ptr;
   }
 
-  if (prev_free && !next_free) {
-    prev_block->size += (free_node->size + (int)sizeof(block_header));
-    prev_block->next = free_node->next;
-    return 0;
+  // No room here, so move it
+  new_ptr = Mem_Alloc(size);
+  if (new_ptr == NULL) {
+    return NULL;
   }
+  memcpy(new_ptr, ptr, curr_node->size);
+  Mem_Free(ptr);
+  return new_ptr;
+}
+
+int free_block(void *ptr) {   
+  block_header* free_node = NULL; // The block that ptr is indeed referencing 
+  run_header* r = NULL;
+  int i;
   
-  if (!prev_free && next_free) {
-    free_node->size += (next_block->size + (int)sizeof(block_header));
-    free_node->next = next_block->next;
+  if (ptr == NULL) {
+    return -1;
+  }
+
+  r = run_of(ptr);
+  if (r != NULL) {
+    i = run_index(r, ptr);
+    if (i < 0) {
+      return -1; // not the start of an object that is handed out
+    }
+    stats.frees++;
+    free_small(r, i);
     return 0;
   }
 
-  if (prev_free && next_free) {
-    prev_block->size += free_node->size + next_block->size + (2 * (int)sizeof(block_header));
-    prev_block->next = next_block->next;
+  // Ensure pointer points to something that was alloacted by Mem_Alloc() 
+  free_node = find_in_use(ptr);
+  if (free_node == NULL) {
+    return -1; // there is no block that ptr was pointing to
+  }
+  stats.frees++;
+
+#ifdef MEM_DEBUG
+  if (is_guarded(free_node)) {
+    free_guarded(free_node);
+    return 0;
   }
+
+  // Swap it for the oldest block in quarantine, which is the one freed now
+  debug_poison(ptr, free_node->size);
+  free_node->in_use = QUARANTINED;
+  ptr = quarantine[quarantine_next];
+  quarantine[quarantine_next] = free_node;
+  quarantine_next = (quarantine_next + 1) % QUARANTINE_SIZE;
+  if (ptr == NULL) {
+    return 0;
+  }
+  free_node = (block_header*) ptr;
+  debug_check_poison((char*) free_node + sizeof(block_header), free_node->size);
+#endif
+  ptr = NULL;
+
+  release_block(free_node);
   return 0;
 }
 
-int Mem_Available() {
-  block_header* curr_node = head;
-  int total_available = 0;
+int Mem_Free(void *ptr) {
+  return TIME_CALL(stats.free_cycles, free_block(ptr));
+}
 
-  while (curr_node != NULL) {
-    if (!(curr_node->in_use)) {
-      total_available += curr_node->size;
-    }
-    curr_node = curr_node->next;      
+// How many bytes the caller may use at ptr, or -1 if it isn't a block in use
+int Mem_UsableSize(void* ptr) {
+  block_header* curr_node = NULL;
+  run_header* r = run_of(ptr);
+
+  if (r != NULL) {
+    return run_index(r, ptr) < 0 ? -1 : r->object_size;
+  }
+  curr_node = find_in_use(ptr);
+  if (curr_node == NULL) {
+    return -1;
   }
-  printf("%d\n", total_available);
-  return total_available;
+  return curr_node->size;
+}
+
+int Mem_Available() {
+  return stats.free;
 }
 
 void Mem_Dump() {
   block_header* curr_node= NULL;
+  chunk* c;
   int status;
   char* begin_addr = NULL;
   char* end_addr = NULL;
   int size;
 
-  curr_node = head;
   printf("status\tstart_addr\tend_addr\tsize\t\n");
-  while(curr_node != NULL) {
-    begin_addr = (char*)curr_node + (int)sizeof(block_header);
-    size = curr_node->size;
-    status = curr_node->in_use;
-    end_addr  = begin_addr + size;
-    printf("%d\t%p\t%p\t%d\t\n",status,begin_addr,end_addr,size);
-    curr_node = curr_node->next;
+  for (c = chunk_list; c != NULL; c = c->next) {
+    for (curr_node = (block_header*) c->start; curr_node != NULL; curr_node = block_after(curr_node)) {
+      begin_addr = (char*)curr_node + (int)sizeof(block_header);
+      size = curr_node->size;
+      status = curr_node->in_use;
+      end_addr  = begin_addr + size;
+      printf("%d\t%p\t%p\t%d\t\n",status,begin_addr,end_addr,size);
+    }
   }
   return;
 }
+
+void Mem_Stats(struct mem_stats* out) {
+  tree_node* n = root;
+  int i;
+
+  // The largest free block is the rightmost one in the tree, or the one
+  // in the highest bin if the tree is empty, unless a quick listed block or
+  // a free object in a run is bigger
+  stats.largest_free = 0;
+  if (n != NULL) {
+    while (n->right != NULL) {
+      n = n->right;
+    }
+    stats.largest_free = header_of(n)->size;
+  } else if (bin_map) {
+    stats.largest_free = MIN_FREE + ALIGN * (63 - __builtin_clzll(bin_map));
+  }
+  if (quick_map && MIN_FREE + ALIGN * (31 - __builtin_clz(quick_map)) > stats.largest_free) {
+    stats.largest_free = MIN_FREE + ALIGN * (31 - __builtin_clz(quick_map));
+  }
+  for (i = 0; i < NUM_CLASSES; i++) {
+    if (runs[i] != NULL && runs[i]->object_size > stats.largest_free) {
+      stats.largest_free = runs[i]->object_size;
+    }
+  }
+
+  *out = stats;
+  out->fragmentation = 0;
+  if (stats.free > 0) {
+    out->fragmentation = 1.0 - (double) stats.largest_free / stats.free;
+  }
+}
+
+// Check the tree below n, whose parent is parent, counting its nodes into
+// *count. Returns how many black nodes are on every path down from n, or
+// -1 if something is wrong.
+int check_tree(tree_node* n, tree_node* parent, long* count) {
+  block_header* b;
+  int left, right;
+
+  if (n == NULL) {
+    return 0;
+  }
+  b = header_of(n);
+  if (chunk_find(b) == NULL || n->parent != parent) {
+    return check_failed("bad tree link", n);
+  }
+  if (b->in_use || b->size < TREE_MIN) {
+    return check_failed("tree holds a block it shouldn't", b);
+  }
+  if (++*count > stats.free_blocks) {
+    return check_failed("tree has a loop", n);
+  }
+  if (n->red && (is_red(n->left) || is_red(n->right))) {
+    return check_failed("red tree node with a red child", n);
+  }
+  if ((n->left != NULL && !tree_less(n->left, n)) || (n->right != NULL && !tree_less(n, n->right))) {
+    return check_failed("tree out of order", n);
+  }
+  left = check_tree(n->left, n, count);
+  right = check_tree(n->right, n, count);
+  if (left < 0 || right < 0) {
+    return -1;
+  }
+  if (left != right) {
+    return check_failed("tree out of balance", n);
+  }
+  return left + !n->red;
+}
+
+// Check run r, which is in block b. Returns 0 if all is well, or -1.
+int check_run(run_header* r, block_header* b) {
+  int used = 0;
+  int i;
+
+  if ((uintptr_t) r % RUN_SIZE || b->size < RUN_SIZE || r->magic != (RUN_MAGIC ^ (uintptr_t) r)) {
+    return check_failed("bad run", r);
+  }
+  if (r->object_size < 16 || r->object_size > SMALL_MAX || r->object_size % 16) {
+    return check_failed("bad run object size", r);
+  }
+  for (i = 0; i < RUN_SIZE / 16; i++) {
+    if ((r->used[i / 64] >> (i % 64)) & 1) {
+      if (i >= run_objects(r)) {
+        return check_failed("run object past the end of the run", r);
+      }
+      used++;
+#ifdef MEM_DEBUG
+      if (debug_unpoisoned(run_object(r, i) + r->object_size, RED_ZONE) != NULL) {
+        return check_failed("write past the end of an object", run_object(r, i));
+      }
+    } else if (i < run_objects(r) && debug_unpoisoned(run_object(r, i), run_stride(r)) != NULL) {
+      return check_failed("write after free", run_object(r, i));
+#endif
+    }
+  }
+  if (used + r->free != run_objects(r)) {
+    return check_failed("run free count is wrong", r);
+  }
+  return 0;
+}
+
+// Walk the whole heap and check that it hangs together: the blocks tile
+// each chunk, the bins, tree, quick lists and run lists hold exactly the
+// blocks and runs they should, and the counters match. Returns 0 if all is well, or reports the
+// first problem on stderr and returns -1.
+int Mem_Check() {
+  block_header* curr_node = NULL;
+  block_header* prev = NULL;
+  bin_node* node = NULL;
+  run_header* r = NULL;
+  chunk* c = NULL;
+  long free_bytes = 0, free_count = 0, quick_count = 0, in_use_bytes = 0;
+  long indexed = 0, listed = 0, bytes = 0;
+  long small_count = 0, run_total = 0, with_free = 0, linked = 0;
+  int zeroed;
+  int i;
+
+  // The blocks of each chunk cover it from one end to the other
+  for (c = chunk_list; c != NULL; c = c->next) {
+    for (prev = NULL, curr_node = (block_header*) c->start; curr_node != NULL;
+         prev = curr_node, curr_node = block_after(curr_node)) {
+      if ((char*) curr_node + (int)sizeof(block_header) > c->end) {
+        return check_failed("block outside the heap", curr_node);
+      }
+      if (curr_node->canary != canary_of(curr_node)) {
+        return check_failed("block header overwritten", curr_node);
+      }
+      if (curr_node->prev_size != (prev == NULL ? 0 : prev->size)) {
+        return check_failed("bad boundary tag", curr_node);
+      }
+      if (curr_node->size < MIN_FREE || curr_node->size % ALIGN ||
+          (char*) curr_node + (int)sizeof(block_header) + curr_node->size > c->end) {
+        return check_failed("bad block size", curr_node);
+      }
+      if (curr_node->last != ((char*) curr_node + (int)sizeof(block_header) + curr_node->size == c->end)) {
+        return check_failed("chunk doesn't end with its last block", curr_node);
+      }
+
+      switch (curr_node->in_use) {
+      case 0:
+        if (prev != NULL && !(prev->in_use)) {
+          return check_failed("free blocks not merged", curr_node);
+        }
+        zeroed = block_zeroed(curr_node);
+        for (i = 0; i < zeroed; i++) {
+          if (((char*) curr_node)[(int)sizeof(block_header) + curr_node->size - zeroed + i]) {
+            return check_failed("zeroed bytes aren't zero", curr_node);
+          }
+        }
+        free_bytes += curr_node->size;
+        free_count++;
+        break;
+      case 1:
+        in_use_bytes += curr_node->size;
+        break;
+      case QUICKLISTED:
+        free_bytes += curr_node->size;
+        free_count++;
+        quick_count++;
+        break;
+      case RUN:
+        r = (run_header*) ((char*) curr_node + sizeof(block_header));
+        if (check_run(r, curr_node) < 0) {
+          return -1;
+        }
+        in_use_bytes += (long) (run_objects(r) - r->free) * r->object_size;
+        free_bytes += (long) r->free * r->object_size;
+        free_count += r->free;
+        small_count += r->free;
+        run_total++;
+        with_free += r->free > 0;
+        break;
+  #ifdef MEM_DEBUG
+      case QUARANTINED:
+        if (debug_unpoisoned((char*) curr_node + sizeof(block_header), curr_node->size) != NULL) {
+          return check_failed("write after free", curr_node);
+        }
+        in_use_bytes += curr_node->size;
+        break;
+  #endif
+      default:
+        return check_failed("bad in_use", curr_node);
+      }
+    }
+  }
+#ifdef MEM_DEBUG
+  for (curr_node = guarded_head; curr_node != NULL; curr_node = curr_node->next) {
+    if (curr_node->canary != canary_of(curr_node)) {
+      return check_failed("block header overwritten", curr_node);
+    }
+    in_use_bytes += curr_node->size;
+  }
+#endif
+
+  // Every free block is in the bin or the tree, and nothing else is
+  for (i = 0; i < NUM_BINS; i++) {
+    if ((bins[i] != NULL) != ((bin_map >> i) & 1)) {
+      return check_failed("bin map is wrong", &bins[i]);
+    }
+    for (node = bins[i]; node != NULL; node = node->next) {
+      curr_node = header_of(node);
+      if (chunk_find(curr_node) == NULL || curr_node->in_use || bin_index(curr_node->size) != i) {
+        return check_failed("bin holds a block it shouldn't", curr_node);
+      }
+      if ((node->prev == NULL) != (node == bins[i]) || (node->next != NULL && node->next->prev != node)) {
+        return check_failed("bad bin link", curr_node);
+      }
+      if (++indexed > free_count) {
+        return check_failed("bin has a loop", curr_node);
+      }
+    }
+  }
+  if (root != NULL && (root->red || root->parent != NULL)) {
+    return check_failed("bad tree root", root);
+  }
+  if (check_tree(root, NULL, &indexed) < 0) {
+    return -1;
+  }
+  if (indexed != free_count - quick_count - small_count) {
+    return check_failed("free blocks missing from the bins and tree", NULL);
+  }
+
+  for (i = 0; i < NUM_QUICK; i++) {
+    if ((quick[i] != NULL) != ((quick_map >> i) & 1)) {
+      return check_failed("quick map is wrong", &quick[i]);
+    }
+    for (node = quick[i]; node != NULL; node = node->next) {
+      curr_node = header_of(node);
+      if (chunk_find(curr_node) == NULL || curr_node->in_use != QUICKLISTED || bin_index(curr_node->size) != i) {
+        return check_failed("quick list holds a block it shouldn't", curr_node);
+      }
+      if (++listed > quick_count) {
+        return check_failed("quick list has a loop", curr_node);
+      }
+      bytes += curr_node->size;
+    }
+  }
+  if (listed != quick_count || bytes != quick_bytes) {
+    return check_failed("quick listed blocks missing from the quick lists", NULL);
+  }
+
+  // Every run with objects free is on the list for its size
+  for (i = 0; i < NUM_CLASSES; i++) {
+    for (r = runs[i]; r != NULL; r = r->next) {
+      if (chunk_find(r) == NULL || r->magic != (RUN_MAGIC ^ (uintptr_t) r) ||
+          r->object_size != (i + 1) * 16 || r->free == 0) {
+        return check_failed("run list holds a run it shouldn't", r);
+      }
+      if ((r->prev == NULL) != (r == runs[i]) || (r->next != NULL && r->next->prev != r)) {
+        return check_failed("bad run link", r);
+      }
+      if (++linked > with_free) {
+        return check_failed("run list has a loop", r);
+      }
+    }
+  }
+  if (linked != with_free || run_total != run_count) {
+    return check_failed("runs missing from the run lists", NULL);
+  }
+
+  if (free_bytes != stats.free || free_count != stats.free_blocks || in_use_bytes != stats.in_use) {
+    return check_failed("counters don't match the heap", &stats);
+  }
+  return 0;
+}
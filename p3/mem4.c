@@ -0,0 +1,544 @@
+/*
+ * Binary buddy allocator: blocks of any size, rounded up to a power of two
+ *
+ * Each arena is one mapping of 2^n * MIN_BLOCK bytes, viewed as a binary
+ * tree of blocks. Splitting a block gives two halves (buddies), and when
+ * both halves are free again they merge back into their parent. There are
+ * no block headers: two bitmaps outside the arena say which tree nodes
+ * are split and which are free, and free blocks are kept on one list per
+ * order. A block of order k is MIN_BLOCK << k bytes and always starts at a
+ * multiple of its own size from the arena base.
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <string.h>
+#include <limits.h>
+#include <stdint.h>
+#include "mem.h"
+#include "chunk.h"
+#include "stats.h"
+#include "debug.h"
+
+#define MIN_SHIFT 4                 // the smallest block is 16 bytes
+#define MIN_BLOCK (1 << MIN_SHIFT)
+#define MAX_ORDER 27                // the largest arena is 2 GiB
+#define MAX_ARENAS 32
+
+// Free blocks keep their list links in the block itself
+typedef struct free_node {
+  struct free_node* next;
+  struct free_node* prev;
+} free_node;
+
+typedef struct arena {
+  char* base;
+  int order;                  // the whole arena is one block of this order
+  unsigned char* split_bits;  // one bit per node: the block is split in two
+  unsigned char* free_bits;   // one bit per node: the block is on a free list
+  size_t bits_size;           // bytes mapped for the bitmaps
+  int numa_node;              // NUMA node the arena was placed on, or -1
+  free_node* free_lists[MAX_ORDER + 1];
+} arena;
+
+// Nodes are numbered like a heap: the root is 0, the children of node i
+// are 2i+1 and 2i+2, and the nodes at depth d start at 2^d - 1
+arena arenas[MAX_ARENAS];
+int num_arenas = 0;
+int last_order = 0;      // of the arena mapped last, which the next one doubles
+int grow = 0;            // true if more arenas are mapped when the heap fills
+struct mem_stats stats;  // kept up to date on every call, see Mem_Stats()
+
+long block_size(int order) {
+  return (long) MIN_BLOCK << order;
+}
+
+// The smallest order whose blocks hold size bytes
+int order_for(long size) {
+  int order = 0;
+
+  while (block_size(order) < size) {
+    order++;
+  }
+  return order;
+}
+
+int get_bit(unsigned char* bits, long node) {
+  return (bits[node >> 3] >> (node & 7)) & 1;
+}
+
+void set_bit(unsigned char* bits, long node) {
+  bits[node >> 3] |= 1 << (node & 7);
+}
+
+void clear_bit(unsigned char* bits, long node) {
+  bits[node >> 3] &= ~(1 << (node & 7));
+}
+
+// The node of order order that starts at ptr
+long node_at(arena* a, char* ptr, int order) {
+  int depth = a->order - order;
+
+  return ((1L << depth) - 1) + ((ptr - a->base) >> (MIN_SHIFT + order));
+}
+
+char* node_start(arena* a, long node, int order) {
+  int depth = a->order - order;
+
+  return a->base + ((node - ((1L << depth) - 1)) << (MIN_SHIFT + order));
+}
+
+long buddy_of(long node) {
+  return (node & 1) ? node + 1 : node - 1;
+}
+
+void push_free(arena* a, long node, int order) {
+  free_node* b = (free_node*) node_start(a, node, order);
+
+  b->prev = NULL;
+  b->next = a->free_lists[order];
+  if (b->next != NULL) {
+    b->next->prev = b;
+  }
+  a->free_lists[order] = b;
+  set_bit(a->free_bits, node);
+
+  stats.free += block_size(order);
+  stats.free_blocks++;
+  stats.free_hist[stats_bucket(block_size(order))]++;
+}
+
+void unlink_free(arena* a, long node, int order) {
+  free_node* b = (free_node*) node_start(a, node, order);
+
+  if (b->prev != NULL) {
+    b->prev->next = b->next;
+  } else {
+    a->free_lists[order] = b->next;
+  }
+  if (b->next != NULL) {
+    b->next->prev = b->prev;
+  }
+  clear_bit(a->free_bits, node);
+
+  stats.free -= block_size(order);
+  stats.free_blocks--;
+  stats.free_hist[stats_bucket(block_size(order))]--;
+}
+
+// Split node in two, keeping the first half and freeing the second
+long split_node(arena* a, long node, int order) {
+  set_bit(a->split_bits, node);
+  push_free(a, 2 * node + 2, order - 1);
+  return 2 * node + 1;
+}
+
+// Take a block of the given order from arena a, splitting a bigger one if
+// there is none of that size
+char* arena_alloc(arena* a, int order) {
+  int k = order;
+  long node;
+  char* ptr;
+
+  while (k <= a->order && a->free_lists[k] == NULL) {
+    k++;
+  }
+  if (k > a->order) {
+    return NULL;
+  }
+
+  ptr = (char*) a->free_lists[k];
+  node = node_at(a, ptr, k);
+  unlink_free(a, node, k);
+  while (k > order) {
+    node = split_node(a, node, k);
+    k--;
+  }
+
+  stats.in_use += block_size(order);
+  stats.allocs++;
+  return ptr;
+}
+
+arena* find_arena(void* ptr) {
+  int i;
+
+  for (i = 0; i < num_arenas; i++) {
+    if ((char*) ptr >= arenas[i].base && (char*) ptr < arenas[i].base + block_size(arenas[i].order)) {
+      return &arenas[i];
+    }
+  }
+  return NULL;
+}
+
+// Find the block in use that starts at ptr by walking down the split
+// nodes. Returns its node and sets *order, or -1 if ptr isn't one.
+long find_in_use(arena* a, void* ptr, int* order) {
+  long offset = (char*) ptr - a->base;
+  long node = 0;
+  int k = a->order;
+
+  while (get_bit(a->split_bits, node)) {
+    k--;
+    node = 2 * node + 1 + ((offset >> (MIN_SHIFT + k)) & 1);
+  }
+  if (node_start(a, node, k) != (char*) ptr || get_bit(a->free_bits, node)) {
+    return -1;
+  }
+  *order = k;
+  return node;
+}
+
+// Map an arena of the given order on NUMA node numa_node (-1 for anywhere)
+// and make it one free block
+arena* add_arena(int order, int numa_node) {
+  arena* a;
+  long nodes = (2L << order) - 1;
+  size_t bits_size;
+
+  if (num_arenas == MAX_ARENAS || order > MAX_ORDER) {
+    return NULL;
+  }
+  a = &arenas[num_arenas];
+  memset(a, 0, sizeof(arena));
+
+  bits_size = chunk_round(2 * ((nodes + 7) / 8));
+  a->base = chunk_map_region(block_size(order), numa_node);
+  if (a->base == NULL) {
+    return NULL;
+  }
+  a->split_bits = (unsigned char*) chunk_map_region(bits_size, numa_node);
+  if (a->split_bits == NULL) {
+    munmap(a->base, block_size(order));
+    return NULL;
+  }
+  a->free_bits = a->split_bits + bits_size / 2;
+  a->bits_size = bits_size;
+  a->order = order;
+  a->numa_node = numa_node;
+
+  num_arenas++;
+  last_order = order;
+  push_free(a, 0, order);
+  return a;
+}
+
+// Unmap arena a, which must be one free block, unless it is the first one
+// or the heap would be left short
+void release_arena(arena* a) {
+  long size = block_size(a->order);
+
+  if (a == &arenas[0] || stats.free - size < size) {
+    return;
+  }
+  unlink_free(a, 0, a->order);
+  munmap(a->base, size);
+  munmap(a->split_bits, a->bits_size);
+
+  num_arenas--;
+  *a = arenas[num_arenas];
+}
+
+int Mem_Init(int size) {
+  return Mem_InitFlags(size, 0);
+}
+
+int Mem_InitFlags(int size, int flags) {
+  static int already_called = 0; // this function can only be called once
+  int order;
+
+  if (already_called || size <= 0) {
+    return -1;
+  }
+
+  // The arena is rounded up to a power of two, at least a page
+  order = order_for(size);
+  while (block_size(order) < getpagesize()) {
+    order++;
+  }
+  chunk_placement = flags & (MEM_HUGETLB | MEM_NUMA);
+  if (add_arena(order, chunk_local_node()) == NULL) {
+    return -1;
+  }
+
+  grow = flags & MEM_GROW;
+  already_called = 1;
+  return 0;
+}
+
+// Take a block of the given order from the first arena on NUMA node
+// numa_node that has one, or from any arena if numa_node is -1
+char* alloc_on_node(int order, int numa_node) {
+  char* ptr;
+  int i;
+
+  for (i = 0; i < num_arenas; i++) {
+    if (numa_node == -1 || arenas[i].numa_node == numa_node) {
+      ptr = arena_alloc(&arenas[i], order);
+      if (ptr != NULL) {
+        return ptr;
+      }
+    }
+  }
+  return NULL;
+}
+
+// With MEM_NUMA, each thread is served from the arenas on its own node,
+// and a new arena is mapped there when they are full. Other nodes' arenas
+// are only used when that can't be done.
+char* alloc_order(int order) {
+  char* ptr;
+  int grow_order;
+  int numa_node = chunk_local_node();
+
+  ptr = alloc_on_node(order, numa_node);
+  if (ptr != NULL) {
+    return ptr;
+  }
+
+  if (grow) {
+    // Each new arena is twice the size of the last, and big enough for this
+    grow_order = last_order + 1;
+    if (grow_order < order) {
+      grow_order = order;
+    }
+    if (grow_order > MAX_ORDER) {
+      grow_order = MAX_ORDER;
+    }
+    if (grow_order >= order && add_arena(grow_order, numa_node) != NULL) {
+      return arena_alloc(&arenas[num_arenas - 1], order);
+    }
+  }
+  return numa_node == -1 ? NULL : alloc_on_node(order, -1);
+}
+
+void* alloc_block(int size) {
+  char* ptr;
+  int order;
+
+  if (size <= 0) {
+    return NULL;
+  }
+  order = order_for(size);
+  ptr = alloc_order(order);
+  if (ptr != NULL) {
+    stats.size_hist[stats_bucket(block_size(order))]++;
+  }
+  return ptr;
+}
+
+void* Mem_Alloc(int size) {
+  return TIME_CALL(stats.alloc_cycles, alloc_block(size));
+}
+
+// Blocks are aligned to their own size, so asking for a block at least as
+// big as align is enough
+void* Mem_AllocAligned(int size, int align) {
+  if (size <= 0 || align <= 0 || (align & (align - 1)) || align > getpagesize()) {
+    return NULL;
+  }
+  return Mem_Alloc(size > align ? size : align);
+}
+
+void* Mem_Calloc(int count, int size) {
+  void* ptr;
+
+  if (count <= 0 || size <= 0 || count > INT_MAX / size) {
+    return NULL;
+  }
+  ptr = Mem_Alloc(count * size);
+  if (ptr != NULL) {
+    memset(ptr, 0, count * size);
+  }
+  return ptr;
+}
+
+void* Mem_Realloc(void* ptr, int size) {
+  arena* a;
+  long node, n;
+  int order, new_order, k;
+  void* new_ptr;
+
+  if (ptr == NULL) {
+    return Mem_Alloc(size);
+  }
+  if (size <= 0) {
+    Mem_Free(ptr);
+    return NULL;
+  }
+  a = find_arena(ptr);
+  if (a == NULL || (node = find_in_use(a, ptr, &order)) < 0) {
+    return NULL;
+  }
+  new_order = order_for(size);
+
+  // Shrinking gives back the second half until the block fits
+  if (new_order <= order) {
+    stats.in_use -= block_size(order) - block_size(new_order);
+    while (order > new_order) {
+      node = split_node(a, node, order);
+      order--;
+    }
+    return ptr;
+  }
+
+  // Growing in place works while the block is a first half whose buddy
+  // is free all the way up to the new size
+  n = node;
+  for (k = order; k < new_order && k < a->order; k++) {
+    if (!(n & 1) || !get_bit(a->free_bits, n + 1)) {
+      break;
+    }
+    n = (n - 1) / 2;
+  }
+  if (k == new_order) {
+    for (k = order; k < new_order; k++) {
+      unlink_free(a, node + 1, k);
+      node = (node - 1) / 2;
+      clear_bit(a->split_bits, node);
+    }
+    stats.in_use += block_size(new_order) - block_size(order);
+    return ptr;
+  }
+
+  new_ptr = Mem_Alloc(size);
+  if (new_ptr == NULL) {
+    return NULL;
+  }
+  memcpy(new_ptr, ptr, block_size(order));
+  Mem_Free(ptr);
+  return new_ptr;
+}
+
+int free_block(void* ptr) {
+  arena* a;
+  long node;
+  int order;
+
+  if (ptr == NULL || (a = find_arena(ptr)) == NULL) {
+    return -1;
+  }
+  node = find_in_use(a, ptr, &order);
+  if (node < 0) {
+    return -1;
+  }
+  stats.in_use -= block_size(order);
+  stats.frees++;
+  debug_poison(ptr, block_size(order));
+
+  // Merge with the buddy for as long as it is free too
+  while (node > 0 && get_bit(a->free_bits, buddy_of(node))) {
+    unlink_free(a, buddy_of(node), order);
+    node = (node - 1) / 2;
+    clear_bit(a->split_bits, node);
+    order++;
+  }
+  push_free(a, node, order);
+
+  if (grow && node == 0) {
+    release_arena(a);
+  }
+  return 0;
+}
+
+int Mem_Free(void* ptr) {
+  return TIME_CALL(stats.free_cycles, free_block(ptr));
+}
+
+// How many bytes the caller may use at ptr, or -1 if it isn't a block in use
+int Mem_UsableSize(void* ptr) {
+  arena* a = find_arena(ptr);
+  int order;
+
+  if (a == NULL || find_in_use(a, ptr, &order) < 0) {
+    return -1;
+  }
+  return block_size(order) > INT_MAX ? INT_MAX : block_size(order);
+}
+
+int Mem_Available() {
+  return stats.free > INT_MAX ? INT_MAX : stats.free;
+}
+
+void Mem_Dump() {
+  free_node* b;
+  int i, k, count;
+
+  for (i = 0; i < num_arenas; i++) {
+    printf("arena %d\t%p\t%p\n", i, arenas[i].base, arenas[i].base + block_size(arenas[i].order));
+    printf("order\tsize\tfree\n");
+    for (k = 0; k <= arenas[i].order; k++) {
+      count = 0;
+      for (b = arenas[i].free_lists[k]; b != NULL; b = b->next) {
+        count++;
+      }
+      printf("%d\t%ld\t%d\n", k, block_size(k), count);
+    }
+  }
+}
+
+// The largest free block is whatever is on the highest non-empty list
+void Mem_Stats(struct mem_stats* out) {
+  int i, k;
+
+  stats.largest_free = 0;
+  for (i = 0; i < num_arenas; i++) {
+    for (k = arenas[i].order; k >= 0; k--) {
+      if (arenas[i].free_lists[k] != NULL) {
+        if (block_size(k) > stats.largest_free) {
+          stats.largest_free = block_size(k);
+        }
+        break;
+      }
+    }
+  }
+
+  *out = stats;
+  out->fragmentation = 0;
+  if (stats.free > 0) {
+    out->fragmentation = 1.0 - (double) stats.largest_free / stats.free;
+  }
+}
+
+// Walk every free list and check each block against the bitmaps: it is
+// marked free and not split, its parent is split and its buddy isn't free
+// (or they would have merged). Returns 0 if all is well, or reports the
+// first problem on stderr and returns -1.
+int Mem_Check() {
+  arena* a;
+  free_node* b;
+  long node, free_bytes = 0, free_count = 0, total = 0;
+  int i, k;
+
+  for (i = 0; i < num_arenas; i++) {
+    a = &arenas[i];
+    total += block_size(a->order);
+    for (k = 0; k <= a->order; k++) {
+      for (b = a->free_lists[k]; b != NULL; b = b->next) {
+        if ((char*) b < a->base || (char*) b >= a->base + block_size(a->order) ||
+            ((char*) b - a->base) % block_size(k)) {
+          return check_failed("free list entry isn't a block", b);
+        }
+        node = node_at(a, (char*) b, k);
+        if (!get_bit(a->free_bits, node) || (k > 0 && get_bit(a->split_bits, node))) {
+          return check_failed("free block not marked free", b);
+        }
+        if (node > 0 && (!get_bit(a->split_bits, (node - 1) / 2) || get_bit(a->free_bits, buddy_of(node)))) {
+          return check_failed("free block should have merged", b);
+        }
+        if ((b->prev == NULL) != (b == a->free_lists[k]) || (b->next != NULL && b->next->prev != b)) {
+          return check_failed("bad free list link", b);
+        }
+        if (++free_count > (2L << a->order)) {
+          return check_failed("free list has a loop", b);
+        }
+        free_bytes += block_size(k);
+      }
+    }
+  }
+  if (free_bytes != stats.free || free_count != stats.free_blocks || total != stats.in_use + stats.free) {
+    return check_failed("counters don't match the heap", &stats);
+  }
+  return 0;
+}
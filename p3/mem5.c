@@ -0,0 +1,767 @@
+/*
+ * Persistent heap: blocks of any size, in a heap that can live in a file
+ * (see memfile.h) and be shared by several processes at once
+ *
+ * Each process may map the heap at a different address, so nothing in it
+ * holds a pointer: blocks are found by their offset from the start of the
+ * heap. Every block has a header with its own size and the size of the
+ * block before it, so merging with either neighbour needs no search. Free
+ * blocks are on doubly linked lists, one per power of two of size (bins).
+ *
+ * Each call takes a lock kept in the heap, shared between processes. All
+ * writes to the heap's own bookkeeping go through an undo log in the heap
+ * header, which is emptied when the call ends. If a process dies in the
+ * middle of a call, whoever takes the lock next (or opens the heap next,
+ * if nobody else had it open) rolls those writes back, leaving the heap as
+ * it was before the call. The contents of blocks aren't logged.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <pthread.h>
+#include "mem.h"
+#include "memfile.h"
+#include "stats.h"
+#include "debug.h"
+
+#define HEAP_MAGIC 0x6d656d3568656170ULL
+#define HEAP_VERSION 1
+#define ALIGN 16       // every area starts on and is a multiple of this
+#define MIN_FREE 16    // the smallest area, which has room for the free links
+#define NUM_BINS 32
+#define LOG_SIZE 128   // more writes than any one call makes
+#define USED 1L        // set in size if the block is in use
+
+typedef struct block_header {
+  long size;      // size of the area, plus USED if the block is in use
+  long prev_size; // size of the area of the block before, 0 for the first
+} block_header;
+
+// A free block keeps the offsets of its neighbours on its bin (0 for none)
+// at the start of its area
+typedef struct free_links {
+  long next;
+  long prev;
+} free_links;
+
+typedef struct log_entry {
+  long offset; // of what was written, from the start of the heap
+  long old;    // what was there before
+} log_entry;
+
+// The start of the heap. Blocks follow it, and a fence (an empty block in
+// use) ends the heap so that the last block has a neighbour to look at.
+typedef struct heap_header {
+  unsigned long long magic; // HEAP_MAGIC once the heap is set up
+  long version;
+  long size;                // of the whole heap, this header included
+  long first;               // offset of the first block
+  long root;                // offset of the area set by Mem_SetRoot()
+  long bins[NUM_BINS];      // offset of the first block on each bin
+  long log_count;           // entries in the log for the call in progress
+  log_entry log[LOG_SIZE];
+  struct mem_stats stats;   // fragmentation and largest_free aren't kept
+  pthread_mutex_t lock;     // shared between processes, and robust
+} heap_header;
+
+heap_header* heap = NULL;
+int already_called = 0; // the heap can only be set up once
+
+// Stop the compiler from moving writes to the heap across this point, so
+// that a process that dies leaves the log and the heap in the order they
+// were written in
+static inline void barrier() {
+  __atomic_signal_fence(__ATOMIC_SEQ_CST);
+}
+
+long offset_of(void* ptr) {
+  return (char*) ptr - (char*) heap;
+}
+
+block_header* block_at(long offset) {
+  return (block_header*) ((char*) heap + offset);
+}
+
+long size_of(block_header* b) {
+  return b->size & ~USED;
+}
+
+int in_use(block_header* b) {
+  return b->size & USED;
+}
+
+block_header* next_block(block_header* b) {
+  return (block_header*) ((char*) b + sizeof(block_header) + size_of(b));
+}
+
+block_header* prev_block(block_header* b) {
+  return (block_header*) ((char*) b - b->prev_size - sizeof(block_header));
+}
+
+free_links* links_of(block_header* b) {
+  return (free_links*) (b + 1);
+}
+
+// Write value to the heap's bookkeeping at field, logging what was there
+void log_set(long* field, long value) {
+  log_entry* entry = &heap->log[heap->log_count];
+
+  if (heap->log_count == LOG_SIZE) {
+    fprintf(stderr, "mem5: undo log full\n");
+    abort();
+  }
+  entry->offset = offset_of(field);
+  entry->old = *field;
+  barrier();
+  heap->log_count++;
+  barrier();
+  *field = value;
+}
+
+void log_add(long* counter, long delta) {
+  log_set(counter, *counter + delta);
+}
+
+// Undo the writes of a call that never finished, newest first
+void roll_back() {
+  log_entry* entry;
+
+  while (heap->log_count > 0) {
+    entry = &heap->log[heap->log_count - 1];
+    *(long*) ((char*) heap + entry->offset) = entry->old;
+    barrier();
+    heap->log_count--;
+  }
+}
+
+// Take the heap lock. If the process that had it died, undo what it was
+// in the middle of first.
+void begin_call() {
+  if (pthread_mutex_lock(&heap->lock) == EOWNERDEAD) {
+    roll_back();
+    pthread_mutex_consistent(&heap->lock);
+  }
+}
+
+// The call is done, so its log can go
+void end_call() {
+  barrier();
+  heap->log_count = 0;
+  pthread_mutex_unlock(&heap->lock);
+}
+
+int bin_index(long size) {
+  int i = 63 - __builtin_clzl(size / ALIGN);
+
+  return i < NUM_BINS ? i : NUM_BINS - 1;
+}
+
+void free_add(block_header* b) {
+  long* bin = &heap->bins[bin_index(size_of(b))];
+
+  log_set(&links_of(b)->next, *bin);
+  log_set(&links_of(b)->prev, 0);
+  if (*bin != 0) {
+    log_set(&links_of(block_at(*bin))->prev, offset_of(b));
+  }
+  log_set(bin, offset_of(b));
+  log_add(&heap->stats.free, size_of(b));
+  log_add(&heap->stats.free_blocks, 1);
+  log_add(&heap->stats.free_hist[stats_bucket(size_of(b))], 1);
+}
+
+void free_remove(block_header* b) {
+  free_links* links = links_of(b);
+
+  if (links->prev != 0) {
+    log_set(&links_of(block_at(links->prev))->next, links->next);
+  } else {
+    log_set(&heap->bins[bin_index(size_of(b))], links->next);
+  }
+  if (links->next != 0) {
+    log_set(&links_of(block_at(links->next))->prev, links->prev);
+  }
+  log_add(&heap->stats.free, -size_of(b));
+  log_add(&heap->stats.free_blocks, -1);
+  log_add(&heap->stats.free_hist[stats_bucket(size_of(b))], -1);
+}
+
+// Resize block b to size bytes (keeping whether it is in use) and tell the
+// block after it
+void set_size(block_header* b, long size) {
+  log_set(&b->size, size | (b->size & USED));
+  log_set(&next_block(b)->prev_size, size);
+}
+
+// Put block b, which is marked free but isn't on a bin, on the bins after
+// merging it with the free blocks on either side
+void release_block(block_header* b) {
+  block_header* next = next_block(b);
+  block_header* prev;
+
+  if (!in_use(next)) {
+    free_remove(next);
+    set_size(b, size_of(b) + sizeof(block_header) + size_of(next));
+  }
+  if (offset_of(b) != heap->first) {
+    prev = prev_block(b);
+    if (!in_use(prev)) {
+      free_remove(prev);
+      set_size(prev, size_of(prev) + sizeof(block_header) + size_of(b));
+      b = prev;
+    }
+  }
+  free_add(b);
+}
+
+// Cut block b, which isn't on a bin, down to size bytes and free the rest,
+// if there is enough of it to be a block
+void split_block(block_header* b, long size) {
+  block_header* rest = (block_header*) ((char*) b + sizeof(block_header) + size);
+  long rest_size = size_of(b) - size - sizeof(block_header);
+
+  if (rest_size < MIN_FREE) {
+    return;
+  }
+  log_set(&rest->size, rest_size);
+  log_set(&rest->prev_size, size);
+  log_set(&next_block(b)->prev_size, rest_size);
+  log_set(&b->size, size | (b->size & USED));
+  release_block(rest);
+}
+
+// The first block on the bin for size that is big enough, or else the
+// first block on a bigger bin. NULL if there is none.
+block_header* find_free(long size) {
+  int i = bin_index(size);
+  long offset;
+
+  for (offset = heap->bins[i]; offset != 0; offset = links_of(block_at(offset))->next) {
+    if (size_of(block_at(offset)) >= size) {
+      return block_at(offset);
+    }
+  }
+  for (i++; i < NUM_BINS; i++) {
+    if (heap->bins[i] != 0) {
+      return block_at(heap->bins[i]);
+    }
+  }
+  return NULL;
+}
+
+void count_alloc(block_header* b) {
+  log_add(&heap->stats.in_use, size_of(b));
+  log_add(&heap->stats.allocs, 1);
+  log_add(&heap->stats.size_hist[stats_bucket(size_of(b))], 1);
+}
+
+// Hand out free block b for size bytes
+void* use_block(block_header* b, long size) {
+  free_remove(b);
+  log_set(&b->size, b->size | USED);
+  split_block(b, size);
+  count_alloc(b);
+  return b + 1;
+}
+
+// The block in use that ptr was handed out from, or NULL if there is none.
+// The sizes in the headers on either side have to agree with it, which is
+// enough to tell without walking the heap.
+block_header* find_in_use(void* ptr) {
+  block_header* b = (block_header*) ptr - 1;
+  long offset = offset_of(b);
+  long fence = heap->size - sizeof(block_header);
+
+  if (ptr == NULL || offset < heap->first || offset >= fence || offset % ALIGN) {
+    return NULL;
+  }
+  if (!in_use(b) || size_of(b) < MIN_FREE || size_of(b) > fence - offset - (long) sizeof(block_header)) {
+    return NULL;
+  }
+  if (next_block(b)->prev_size != size_of(b)) {
+    return NULL;
+  }
+  if (offset == heap->first ? b->prev_size != 0 :
+      b->prev_size > offset - heap->first - (long) sizeof(block_header) || size_of(prev_block(b)) != b->prev_size) {
+    return NULL;
+  }
+  return b;
+}
+
+long round_size(int size) {
+  return size < MIN_FREE ? MIN_FREE : ((long) size + ALIGN - 1) & ~(long) (ALIGN - 1);
+}
+
+// Set up the heap lock from scratch. Only safe when nobody can be using it.
+void init_lock() {
+  pthread_mutexattr_t attr;
+
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+  pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+  pthread_mutex_init(&heap->lock, &attr);
+  pthread_mutexattr_destroy(&attr);
+}
+
+// Lay out an empty heap of size bytes. The magic number goes in last, so
+// a heap that was never finished can be told apart.
+int format_heap(long size) {
+  block_header* b;
+  block_header* fence;
+  long first = (sizeof(heap_header) + ALIGN - 1) / ALIGN * ALIGN;
+
+  if (size < first + 2 * (long) sizeof(block_header) + MIN_FREE) {
+    return -1;
+  }
+  memset(heap, 0, sizeof(heap_header));
+  heap->version = HEAP_VERSION;
+  heap->size = size;
+  heap->first = first;
+  init_lock();
+
+  b = block_at(first);
+  b->size = size - first - 2 * sizeof(block_header);
+  b->prev_size = 0;
+  fence = next_block(b);
+  fence->size = USED;
+  fence->prev_size = b->size;
+  free_add(b);
+  heap->log_count = 0;
+
+  barrier();
+  heap->magic = HEAP_MAGIC;
+  return 0;
+}
+
+int Mem_Init(int size) {
+  return Mem_InitFlags(size, 0);
+}
+
+// Without a file the heap is shared memory that only children made with
+// fork() can see. It can't grow, with or without MEM_GROW.
+int Mem_InitFlags(int size, int flags) {
+  long total_size;
+  void* map_ptr;
+
+  if (already_called || size <= 0) {
+    return -1;
+  }
+  total_size = ((long) size + getpagesize() - 1) / getpagesize() * getpagesize();
+  map_ptr = mmap(NULL, total_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (map_ptr == MAP_FAILED) {
+    return -1;
+  }
+  heap = (heap_header*) map_ptr;
+  if (format_heap(total_size) != 0) {
+    munmap(map_ptr, total_size);
+    heap = NULL;
+    return -1;
+  }
+  already_called = 1;
+  return 0;
+}
+
+// Attach to the heap of size bytes just mapped from a file. alone is true
+// if no other process has it open.
+int attach(long size, int alone) {
+  if (heap->magic != HEAP_MAGIC) {
+    // Either new, or whoever was setting it up died before finishing
+    return alone && heap->magic == 0 ? format_heap(size) : -1;
+  }
+  if (heap->version != HEAP_VERSION || heap->size != size) {
+    return -1;
+  }
+  if (alone) {
+    // Nobody holds the lock, whatever it looks like after a crash of the
+    // whole machine, and the call that was cut short can be undone
+    roll_back();
+    init_lock();
+  }
+  return 0;
+}
+
+// The file stays open, with a shared flock() on it, for as long as the
+// process runs. Whoever can get an exclusive one instead knows nobody else
+// has the heap open, so it is safe to set the heap up, or to clean up after
+// processes that died with it open.
+int Mem_Open(const char* path, int size, int flags) {
+  struct stat st;
+  void* map_ptr;
+  int fd;
+  int alone;
+
+  if (already_called || path == NULL) {
+    return -1;
+  }
+  fd = open(path, O_RDWR | O_CREAT, 0600);
+  if (fd == -1) {
+    return -1;
+  }
+  alone = flock(fd, LOCK_EX | LOCK_NB) == 0;
+  if ((!alone && flock(fd, LOCK_SH) != 0) || fstat(fd, &st) != 0) {
+    close(fd);
+    return -1;
+  }
+
+  // A new file gets the size asked for
+  if (st.st_size == 0) {
+    st.st_size = ((long) size + getpagesize() - 1) / getpagesize() * getpagesize();
+    if (!alone || size <= 0 || ftruncate(fd, st.st_size) != 0) {
+      close(fd);
+      return -1;
+    }
+  }
+
+  map_ptr = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (map_ptr == MAP_FAILED) {
+    close(fd);
+    return -1;
+  }
+  heap = (heap_header*) map_ptr;
+  if (attach(st.st_size, alone) != 0) {
+    munmap(map_ptr, st.st_size);
+    heap = NULL;
+    close(fd);
+    return -1;
+  }
+  if (alone) {
+    flock(fd, LOCK_SH);
+  }
+  already_called = 1;
+  return 0;
+}
+
+int Mem_Sync() {
+  int rc;
+
+  if (heap == NULL) {
+    return -1;
+  }
+  begin_call();
+  rc = msync(heap, heap->size, MS_SYNC);
+  end_call();
+  return rc;
+}
+
+long Mem_Offset(void* ptr) {
+  return ptr == NULL ? 0 : offset_of(ptr);
+}
+
+void* Mem_Pointer(long offset) {
+  return offset == 0 ? NULL : (char*) heap + offset;
+}
+
+void Mem_SetRoot(void* ptr) {
+  begin_call();
+  log_set(&heap->root, Mem_Offset(ptr));
+  end_call();
+}
+
+void* Mem_Root() {
+  return heap == NULL ? NULL : Mem_Pointer(heap->root);
+}
+
+void* alloc_block(int size) {
+  block_header* b;
+  long rounded_size;
+
+  if (size <= 0 || size > INT_MAX - ALIGN) {
+    return NULL;
+  }
+  rounded_size = round_size(size);
+  b = find_free(rounded_size);
+  if (b == NULL) {
+    return NULL;
+  }
+  return use_block(b, rounded_size);
+}
+
+void* Mem_Alloc(int size) {
+  void* ptr;
+
+  if (heap == NULL) {
+    return NULL;
+  }
+  begin_call();
+  ptr = TIME_CALL(heap->stats.alloc_cycles, alloc_block(size));
+  end_call();
+  return ptr;
+}
+
+// Take a free block with room to spare, and give back the part in front of
+// the aligned area as a block of its own
+void* Mem_AllocAligned(int size, int align) {
+  block_header* b;
+  block_header* aligned_block;
+  char* area;
+  char* aligned;
+  long rounded_size;
+
+  if (align <= ALIGN) {
+    return Mem_Alloc(size); // every area is 16-byte aligned anyway
+  }
+  if (heap == NULL || size <= 0 || size > INT_MAX / 2 || (align & (align - 1)) || align > getpagesize()) {
+    return NULL;
+  }
+  rounded_size = round_size(size);
+
+  begin_call();
+  b = find_free(rounded_size + 2 * align + sizeof(block_header) + MIN_FREE);
+  if (b == NULL) {
+    end_call();
+    return NULL;
+  }
+  area = (char*) (b + 1);
+  aligned = (char*) (((unsigned long) area + align - 1) & ~((unsigned long) align - 1));
+  while (aligned != area && aligned - area < (long) sizeof(block_header) + MIN_FREE) {
+    aligned += align;
+  }
+
+  free_remove(b);
+  if (aligned != area) {
+    aligned_block = (block_header*) aligned - 1;
+    log_set(&aligned_block->size, (area + size_of(b) - aligned) | USED);
+    log_set(&aligned_block->prev_size, (char*) aligned_block - area);
+    log_set(&next_block(aligned_block)->prev_size, size_of(aligned_block));
+    log_set(&b->size, (char*) aligned_block - area);
+    release_block(b);
+    b = aligned_block;
+  } else {
+    log_set(&b->size, b->size | USED);
+  }
+  split_block(b, rounded_size);
+  count_alloc(b);
+  end_call();
+  return aligned;
+}
+
+void* Mem_Calloc(int count, int size) {
+  void* ptr;
+
+  if (count <= 0 || size <= 0 || count > (INT_MAX - ALIGN) / size) {
+    return NULL;
+  }
+  ptr = Mem_Alloc(count * size);
+  if (ptr != NULL) {
+    memset(ptr, 0, (long) count * size);
+  }
+  return ptr;
+}
+
+int free_block(void* ptr) {
+  block_header* b = find_in_use(ptr);
+
+  if (b == NULL) {
+    return -1;
+  }
+  log_add(&heap->stats.in_use, -size_of(b));
+  log_add(&heap->stats.frees, 1);
+  log_set(&b->size, size_of(b));
+  release_block(b);
+  return 0;
+}
+
+int Mem_Free(void* ptr) {
+  int rc;
+
+  if (heap == NULL) {
+    return -1;
+  }
+  begin_call();
+  rc = TIME_CALL(heap->stats.free_cycles, free_block(ptr));
+  end_call();
+  return rc;
+}
+
+// Shrink in place, grow in place into a free block right after, or else
+// move. Moving is one call, so a crash can't leave both copies allocated.
+void* Mem_Realloc(void* ptr, int size) {
+  block_header* b;
+  block_header* next;
+  long rounded_size;
+  long old_size;
+  void* new_ptr = ptr;
+
+  if (ptr == NULL) {
+    return Mem_Alloc(size);
+  }
+  if (size <= 0) {
+    Mem_Free(ptr);
+    return NULL;
+  }
+  if (heap == NULL || size > INT_MAX - ALIGN) {
+    return NULL;
+  }
+  rounded_size = round_size(size);
+
+  begin_call();
+  b = find_in_use(ptr);
+  if (b == NULL) {
+    end_call();
+    return NULL;
+  }
+  old_size = size_of(b);
+  next = next_block(b);
+  if (rounded_size > old_size && !in_use(next) &&
+      old_size + (long) sizeof(block_header) + size_of(next) >= rounded_size) {
+    free_remove(next);
+    set_size(b, old_size + sizeof(block_header) + size_of(next));
+  }
+
+  if (rounded_size <= size_of(b)) {
+    split_block(b, rounded_size);
+    log_add(&heap->stats.in_use, size_of(b) - old_size);
+  } else {
+    new_ptr = alloc_block(size);
+    if (new_ptr != NULL) {
+      memcpy(new_ptr, ptr, old_size);
+      free_block(ptr);
+    }
+  }
+  end_call();
+  return new_ptr;
+}
+
+int Mem_UsableSize(void* ptr) {
+  block_header* b;
+  int size = -1;
+
+  if (heap == NULL) {
+    return -1;
+  }
+  begin_call();
+  b = find_in_use(ptr);
+  if (b != NULL) {
+    size = size_of(b);
+  }
+  end_call();
+  return size;
+}
+
+int Mem_Available() {
+  return heap == NULL ? 0 : heap->stats.free;
+}
+
+void Mem_Dump() {
+  block_header* b;
+
+  if (heap == NULL) {
+    return;
+  }
+  begin_call();
+  printf("status\tstart_addr\tend_addr\tsize\t\n");
+  for (b = block_at(heap->first); b->size != USED; b = next_block(b)) {
+    printf("%d\t%p\t%p\t%ld\t\n", in_use(b), (void*) (b + 1), (char*) (b + 1) + size_of(b), size_of(b));
+  }
+  end_call();
+}
+
+void Mem_Stats(struct mem_stats* out) {
+  long offset;
+  int i;
+
+  memset(out, 0, sizeof(*out));
+  if (heap == NULL) {
+    return;
+  }
+  begin_call();
+  *out = heap->stats;
+
+  // The largest free block is on the highest bin that isn't empty
+  i = NUM_BINS - 1;
+  while (i > 0 && heap->bins[i] == 0) {
+    i--;
+  }
+  for (offset = heap->bins[i]; offset != 0; offset = links_of(block_at(offset))->next) {
+    if (size_of(block_at(offset)) > out->largest_free) {
+      out->largest_free = size_of(block_at(offset));
+    }
+  }
+  end_call();
+  if (out->free > 0) {
+    out->fragmentation = 1.0 - (double) out->largest_free / out->free;
+  }
+}
+
+int check_heap() {
+  block_header* b;
+  block_header* prev = NULL;
+  long fence = heap->size - sizeof(block_header);
+  long free_bytes = 0, free_count = 0, in_use_bytes = 0, listed = 0;
+  long offset;
+  int i;
+
+  if (heap->log_count != 0) {
+    return check_failed("undo log not empty", heap);
+  }
+  for (b = block_at(heap->first); offset_of(b) != fence; prev = b, b = next_block(b)) {
+    if (offset_of(b) > fence || size_of(b) < MIN_FREE || size_of(b) % ALIGN ||
+        offset_of(b) + (long) sizeof(block_header) + size_of(b) > fence) {
+      return check_failed("bad block size", b);
+    }
+    if (b->prev_size != (prev == NULL ? 0 : size_of(prev))) {
+      return check_failed("size of the block before is wrong", b);
+    }
+    if (in_use(b)) {
+      in_use_bytes += size_of(b);
+    } else {
+      if (prev != NULL && !in_use(prev)) {
+        return check_failed("free blocks not merged", b);
+      }
+      free_bytes += size_of(b);
+      free_count++;
+    }
+  }
+  if (b->size != USED || b->prev_size != (prev == NULL ? 0 : size_of(prev))) {
+    return check_failed("bad fence", b);
+  }
+
+  for (i = 0; i < NUM_BINS; i++) {
+    for (offset = heap->bins[i]; offset != 0; offset = links_of(b)->next) {
+      b = block_at(offset);
+      if (offset < heap->first || offset >= fence || offset % ALIGN || in_use(b) || bin_index(size_of(b)) != i) {
+        return check_failed("bin holds a block it shouldn't", b);
+      }
+      if ((links_of(b)->prev == 0) != (offset == heap->bins[i]) ||
+          (links_of(b)->next != 0 && links_of(block_at(links_of(b)->next))->prev != offset)) {
+        return check_failed("bad bin link", b);
+      }
+      if (++listed > free_count) {
+        return check_failed("bin has a loop", b);
+      }
+    }
+  }
+  if (listed != free_count) {
+    return check_failed("free blocks missing from the bins", NULL);
+  }
+  if (free_bytes != heap->stats.free || free_count != heap->stats.free_blocks ||
+      in_use_bytes != heap->stats.in_use) {
+    return check_failed("counters don't match the heap", &heap->stats);
+  }
+  return 0;
+}
+
+// Walk the whole heap and check that it hangs together: the blocks cover it
+// from the header to the fence and agree on each other's sizes, the bins
+// hold exactly the free blocks, and the counters match. Returns 0 if all is
+// well, or reports the first problem on stderr and returns -1.
+int Mem_Check() {
+  int rc;
+
+  if (heap == NULL) {
+    return 0;
+  }
+  begin_call();
+  rc = check_heap();
+  end_call();
+  return rc;
+}
@@ -0,0 +1,30 @@
+#ifndef _MEMFILE_H_
+#define _MEMFILE_H_
+
+// Heaps that live in a file, so that they can be shared between processes
+// and kept from one run to the next (mem5 only). The heap may be mapped at
+// a different address in every process, so data in it should refer to
+// other blocks by their offset rather than by pointer.
+
+// Open the heap in the file at path instead of calling Mem_Init(). The file
+// is created with room for size bytes if it doesn't exist, otherwise size
+// is ignored and the heap in it is attached to as it is. A path under
+// /dev/shm gives a heap in shared memory that doesn't touch the disk.
+int Mem_Open(const char* path, int size, int flags);
+
+// Write the heap back to its file, so that it survives a crash of the
+// whole machine and not just of the processes using it
+int Mem_Sync();
+
+// Convert between pointers into the heap and offsets from its start. NULL
+// and 0 stand for each other.
+long Mem_Offset(void* ptr);
+
+void* Mem_Pointer(long offset);
+
+// The block that a process attaching to the heap starts from
+void Mem_SetRoot(void* ptr);
+
+void* Mem_Root();
+
+#endif // _MEMFILE_H_
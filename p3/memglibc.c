@@ -0,0 +1,117 @@
+/*
+ * The mem.h interface on top of the C library's malloc, so that the
+ * benchmark can compare the allocators against it
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <malloc.h>
+#include "mem.h"
+#include "stats.h"
+
+struct mem_stats stats;
+
+int Mem_Init(int size) {
+  return Mem_InitFlags(size, 0);
+}
+
+int Mem_InitFlags(int size, int flags) {
+  return size > 0 ? 0 : -1; // malloc grows by itself
+}
+
+void* alloc_block(int size) {
+  void* ptr;
+
+  if (size <= 0) {
+    return NULL;
+  }
+  ptr = malloc(size);
+  if (ptr != NULL) {
+    stats.allocs++;
+    stats.size_hist[stats_bucket(size)]++;
+  }
+  return ptr;
+}
+
+void* Mem_Alloc(int size) {
+  return TIME_CALL(stats.alloc_cycles, alloc_block(size));
+}
+
+void* Mem_AllocAligned(int size, int align) {
+  void* ptr;
+
+  if (size <= 0 || align <= 0) {
+    return NULL;
+  }
+  if (align < (int)sizeof(void*)) {
+    align = sizeof(void*);
+  }
+  if (posix_memalign(&ptr, align, size) != 0) {
+    return NULL;
+  }
+  stats.allocs++;
+  return ptr;
+}
+
+void* Mem_Calloc(int count, int size) {
+  void* ptr;
+
+  if (count <= 0 || size <= 0) {
+    return NULL;
+  }
+  ptr = calloc(count, size);
+  if (ptr != NULL) {
+    stats.allocs++;
+  }
+  return ptr;
+}
+
+void* Mem_Realloc(void* ptr, int size) {
+  if (size <= 0) {
+    free(ptr);
+    return NULL;
+  }
+  return realloc(ptr, size);
+}
+
+int free_block(void* ptr) {
+  if (ptr == NULL) {
+    return -1;
+  }
+  free(ptr);
+  stats.frees++;
+  return 0;
+}
+
+int Mem_Free(void* ptr) {
+  return TIME_CALL(stats.free_cycles, free_block(ptr));
+}
+
+int Mem_UsableSize(void* ptr) {
+  return ptr == NULL ? -1 : (int) malloc_usable_size(ptr);
+}
+
+int Mem_Available() {
+  return mallinfo2().fordblks;
+}
+
+void Mem_Dump() {
+  malloc_stats();
+}
+
+// malloc only tells us totals, so there is no largest block or histogram
+void Mem_Stats(struct mem_stats* out) {
+  struct mallinfo2 info = mallinfo2();
+
+  *out = stats;
+  out->in_use = info.uordblks;
+  out->free = info.fordblks;
+  out->free_blocks = info.ordblks;
+  out->largest_free = 0;
+  out->fragmentation = 0;
+}
+
+// malloc does its own checking, see MALLOC_CHECK_ in mallopt(3)
+int Mem_Check() {
+  return 0;
+}
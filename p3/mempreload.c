@@ -0,0 +1,287 @@
+/*
+ * malloc() and friends on top of the workload 3 allocator, so that it can
+ * be tried on any program without rebuilding it:
+ *
+ *   LD_PRELOAD=./libmempreload.so some_program
+ *
+ * The heap is set up on the first call and grows as needed. MEM_HEAP in
+ * the environment sets the initial size in bytes (default 1 MiB), and
+ * MEM_GUARD (debug builds only), MEM_HUGETLB and MEM_NUMA turn on the
+ * Mem_InitFlags() flags of the same name. One lock serializes every call,
+ * since the allocator itself is not thread safe.
+ * Every block the allocator hands out is 16-byte aligned, as malloc()
+ * promises, so only bigger alignments go through Mem_AllocAligned().
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "mem.h"
+
+#define EXPORT __attribute__((visibility("default")))
+
+#define DEFAULT_HEAP (1 << 20)
+#define MAX_SIZE (INT_MAX - 4096) // Mem_Alloc() only takes an int
+#define BOOTSTRAP_SIZE (64 * 1024)
+#define MIN_ALIGN 16 // alignof(max_align_t)
+
+// Where the heap is in being set up
+#define HEAP_NONE 0
+#define HEAP_STARTING 1
+#define HEAP_READY 2
+#define HEAP_FAILED 3
+
+pthread_mutex_t heap_lock = PTHREAD_MUTEX_INITIALIZER;
+int heap_state = HEAP_NONE;
+pthread_t starting_thread; // the thread setting the heap up
+
+// Anything asked for while the heap is being set up (by code that
+// Mem_Init() calls into) comes from here instead. Each piece starts with
+// its size. It is never freed.
+char bootstrap[BOOTSTRAP_SIZE] __attribute__((aligned(16)));
+int bootstrap_used = 0;
+
+void* bootstrap_alloc(size_t size) {
+  char* ptr;
+  int offset;
+
+  size = (size + 15) & ~(size_t) 15;
+  if (size > BOOTSTRAP_SIZE) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  // Threads only get here without the lock if Mem_Init() failed
+  offset = __atomic_fetch_add(&bootstrap_used, size + 16, __ATOMIC_RELAXED);
+  if (offset + size + 16 > BOOTSTRAP_SIZE) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  ptr = bootstrap + offset;
+  *(size_t*) ptr = size;
+  return ptr + 16;
+}
+
+int from_bootstrap(void* ptr) {
+  return (char*) ptr >= bootstrap && (char*) ptr < bootstrap + BOOTSTRAP_SIZE;
+}
+
+size_t bootstrap_size(void* ptr) {
+  return *(size_t*) ((char*) ptr - 16);
+}
+
+void lock_for_fork() {
+  pthread_mutex_lock(&heap_lock);
+}
+
+void unlock_after_fork() {
+  pthread_mutex_unlock(&heap_lock);
+}
+
+// Take the heap lock, setting the heap up first if this is the first call.
+// Returns 0 without the lock if the heap can't be used: either this call
+// came from inside Mem_Init(), or Mem_Init() failed.
+int lock_heap() {
+  char* env;
+  int size = DEFAULT_HEAP;
+  int flags = MEM_GROW;
+
+  // Other threads may be setting these, so they are read and written
+  // atomically
+  if (__atomic_load_n(&heap_state, __ATOMIC_ACQUIRE) == HEAP_STARTING &&
+      pthread_equal(__atomic_load_n(&starting_thread, __ATOMIC_RELAXED), pthread_self())) {
+    return 0;
+  }
+
+  pthread_mutex_lock(&heap_lock);
+  if (heap_state == HEAP_NONE) {
+    __atomic_store_n(&starting_thread, pthread_self(), __ATOMIC_RELAXED);
+    __atomic_store_n(&heap_state, HEAP_STARTING, __ATOMIC_RELEASE);
+
+    env = getenv("MEM_HEAP");
+    if (env != NULL && atoi(env) > 0) {
+      size = atoi(env);
+    }
+    if (getenv("MEM_GUARD") != NULL) {
+      flags |= MEM_GUARD;
+    }
+    if (getenv("MEM_HUGETLB") != NULL) {
+      flags |= MEM_HUGETLB;
+    }
+    if (getenv("MEM_NUMA") != NULL) {
+      flags |= MEM_NUMA;
+    }
+    if (Mem_InitFlags(size, flags) == 0) {
+      pthread_atfork(lock_for_fork, unlock_after_fork, unlock_after_fork);
+      __atomic_store_n(&heap_state, HEAP_READY, __ATOMIC_RELEASE);
+    } else {
+      __atomic_store_n(&heap_state, HEAP_FAILED, __ATOMIC_RELEASE);
+    }
+  }
+  if (heap_state != HEAP_READY) {
+    pthread_mutex_unlock(&heap_lock);
+    return 0;
+  }
+  return 1;
+}
+
+void unlock_heap() {
+  pthread_mutex_unlock(&heap_lock);
+}
+
+// Allocate size bytes aligned to align. Anything up to MIN_ALIGN is what
+// Mem_Alloc() gives anyway.
+void* heap_alloc(size_t size, size_t align) {
+  void* ptr;
+
+  if (size > MAX_SIZE) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  if (size == 0) {
+    size = 1; // every call has to return a distinct pointer
+  }
+  if (!lock_heap()) {
+    return bootstrap_alloc(size);
+  }
+  if (align > MIN_ALIGN) {
+    ptr = Mem_AllocAligned(size, align);
+  } else {
+    ptr = Mem_Alloc(size);
+  }
+  unlock_heap();
+  if (ptr == NULL) {
+    errno = ENOMEM;
+  }
+  return ptr;
+}
+
+EXPORT void* malloc(size_t size) {
+  return heap_alloc(size, 0);
+}
+
+EXPORT void free(void* ptr) {
+  if (ptr == NULL || from_bootstrap(ptr)) {
+    return;
+  }
+  if (lock_heap()) {
+    Mem_Free(ptr);
+    unlock_heap();
+  }
+}
+
+EXPORT void* calloc(size_t count, size_t size) {
+  void* ptr;
+
+  if (size != 0 && count > MAX_SIZE / size) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  if (count == 0 || size == 0) {
+    count = size = 1;
+  }
+  if (!lock_heap()) {
+    // The bootstrap area is never reused, so it is still zeroed
+    return bootstrap_alloc(count * size);
+  }
+  ptr = Mem_Calloc((int) count, (int) size);
+  unlock_heap();
+  if (ptr == NULL) {
+    errno = ENOMEM;
+  }
+  return ptr;
+}
+
+EXPORT void* realloc(void* ptr, size_t size) {
+  void* new_ptr;
+  size_t old_size;
+
+  if (ptr == NULL) {
+    return malloc(size);
+  }
+  if (size == 0) {
+    free(ptr);
+    return NULL;
+  }
+  if (size > MAX_SIZE) {
+    errno = ENOMEM;
+    return NULL;
+  }
+
+  // Blocks from the bootstrap area move into the heap
+  if (from_bootstrap(ptr)) {
+    new_ptr = malloc(size);
+    if (new_ptr != NULL) {
+      old_size = bootstrap_size(ptr);
+      memcpy(new_ptr, ptr, old_size < size ? old_size : size);
+    }
+    return new_ptr;
+  }
+
+  if (!lock_heap()) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  new_ptr = Mem_Realloc(ptr, size);
+  unlock_heap();
+  if (new_ptr == NULL) {
+    errno = ENOMEM;
+  }
+  return new_ptr;
+}
+
+// Mem_AllocAligned() goes up to a page, and that is all we can offer
+EXPORT int posix_memalign(void** result, size_t align, size_t size) {
+  void* ptr;
+
+  if (align < sizeof(void*) || (align & (align - 1))) {
+    return EINVAL;
+  }
+  if (align > (size_t) getpagesize()) {
+    return ENOMEM;
+  }
+  ptr = heap_alloc(size, align);
+  if (ptr == NULL) {
+    return ENOMEM;
+  }
+  *result = ptr;
+  return 0;
+}
+
+EXPORT void* aligned_alloc(size_t align, size_t size) {
+  void* ptr = NULL;
+  int rc;
+
+  rc = posix_memalign(&ptr, align < sizeof(void*) ? sizeof(void*) : align, size);
+  if (rc != 0) {
+    errno = rc;
+    return NULL;
+  }
+  return ptr;
+}
+
+EXPORT void* memalign(size_t align, size_t size) {
+  return aligned_alloc(align, size);
+}
+
+EXPORT void* valloc(size_t size) {
+  return aligned_alloc(getpagesize(), size);
+}
+
+EXPORT size_t malloc_usable_size(void* ptr) {
+  int size = -1;
+
+  if (ptr == NULL) {
+    return 0;
+  }
+  if (from_bootstrap(ptr)) {
+    return bootstrap_size(ptr);
+  }
+  if (lock_heap()) {
+    size = Mem_UsableSize(ptr);
+    unlock_heap();
+  }
+  return size < 0 ? 0 : size;
+}
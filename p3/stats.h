@@ -0,0 +1,45 @@
+#ifndef _STATS_H_
+#define _STATS_H_
+
+#include "mem.h"
+
+// The log2 histogram bucket that value is counted in
+static inline int stats_bucket(unsigned long long value) {
+  int bucket = 0;
+
+  if (value > 0) {
+    bucket = 63 - __builtin_clzll(value);
+  }
+  return bucket < MEM_HIST_BUCKETS ? bucket : MEM_HIST_BUCKETS - 1;
+}
+
+#ifdef MEM_TIMING
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+
+static inline unsigned long long stats_cycles(void) {
+  return __rdtsc();
+}
+#else
+#include <time.h>
+
+// No cycle counter we can read from user space, so count nanoseconds
+static inline unsigned long long stats_cycles(void) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+#endif
+
+// Evaluate call, counting how long it took in the histogram hist
+#define TIME_CALL(hist, call) ({ \
+  unsigned long long start_ = stats_cycles(); \
+  __typeof__(call) result_ = (call); \
+  (hist)[stats_bucket(stats_cycles() - start_)]++; \
+  result_; })
+#else
+#define TIME_CALL(hist, call) (call)
+#endif
+
+#endif // _STATS_H_
@@ -15,5 +15,7 @@
 #define USERTOP  0xA0000 // end of user address space
 #define PHYSTOP  0x1000000 // use phys mem up to here as free pool
 #define MAXARG       32  // max exec arguments
+#define STACKCHUNK    4  // stack pages mapped on each stack page fault
+#define STACKLIMIT USERTOP // default cap on the stack size (bytes)
 
 #endif // _PARAM_H_
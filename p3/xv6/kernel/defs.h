@@ -66,6 +66,8 @@ void            ioapicinit(void);
 char*           kalloc(void);
 void            kfree(char*);
 void            kinit(void);
+void            kref(char*);
+int             krefs(char*);
 
 // kbd.c
 void            kbdintr(void);
@@ -99,6 +101,7 @@ struct proc*    copyproc(struct proc*);
 void            exit(void);
 int             fork(void);
 int             growproc(int);
+int             growstack(uint, uint);
 int             kill(int);
 void            pinit(void);
 void            procdump(void);
@@ -165,6 +168,7 @@ void            freevm(pde_t*);
 void            inituvm(pde_t*, char*, uint);
 int             loaduvm(pde_t*, char*, struct inode*, uint, uint);
 pde_t*          copyuvm(pde_t*, uint);
+int             copyonwrite(pde_t*, uint);
 void            switchuvm(struct proc*);
 void            switchkvm(void);
 int             copyout(pde_t*, uint, void*, uint);
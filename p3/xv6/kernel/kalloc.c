@@ -1,6 +1,8 @@
 // Physical memory allocator, intended to allocate
 // memory for user processes, kernel stacks, page table pages,
 // and pipe buffers. Allocates 4096-byte pages.
+// User pages can be shared copy-on-write after fork, so each
+// page has a count of the page tables that map it.
 
 #include "types.h"
 #include "defs.h"
@@ -15,6 +17,7 @@ struct run {
 struct {
   struct spinlock lock;
   struct run *freelist;
+  ushort refs[PHYSTOP/PGSIZE];  // references to each page
 } kmem;
 
 extern char end[]; // first address after kernel loaded from ELF file
@@ -31,10 +34,11 @@ kinit(void)
     kfree(p);
 }
 
-// Free the page of physical memory pointed at by v,
-// which normally should have been returned by a
-// call to kalloc().  (The exception is when
-// initializing the allocator; see kinit above.)
+// Drop a reference to the page of physical memory pointed
+// at by v, which normally should have been returned by a
+// call to kalloc(), and free it if that was the last one.
+// (The exception is when initializing the allocator; see
+// kinit above.)
 void
 kfree(char *v)
 {
@@ -43,6 +47,15 @@ kfree(char *v)
   if((uint)v % PGSIZE || v < end || (uint)v >= PHYSTOP) 
     panic("kfree");
 
+  acquire(&kmem.lock);
+  if(kmem.refs[(uint)v / PGSIZE] > 1){
+    kmem.refs[(uint)v / PGSIZE]--;
+    release(&kmem.lock);
+    return;
+  }
+  kmem.refs[(uint)v / PGSIZE] = 0;
+  release(&kmem.lock);
+
   // Fill with junk to catch dangling refs.
   memset(v, 1, PGSIZE);
 
@@ -63,9 +76,36 @@ kalloc(void)
 
   acquire(&kmem.lock);
   r = kmem.freelist;
-  if(r)
+  if(r){
     kmem.freelist = r->next;
+    kmem.refs[(uint)r / PGSIZE] = 1;
+  }
   release(&kmem.lock);
   return (char*)r;
 }
 
+// Take another reference to a page returned by kalloc(),
+// for another page table to map it.
+void
+kref(char *v)
+{
+  if((uint)v % PGSIZE || v < end || (uint)v >= PHYSTOP) 
+    panic("kref");
+
+  acquire(&kmem.lock);
+  kmem.refs[(uint)v / PGSIZE]++;
+  release(&kmem.lock);
+}
+
+// Return how many references there are to a page.
+int
+krefs(char *v)
+{
+  int n;
+
+  acquire(&kmem.lock);
+  n = kmem.refs[(uint)v / PGSIZE];
+  release(&kmem.lock);
+  return n;
+}
+
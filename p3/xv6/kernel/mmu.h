@@ -135,6 +135,10 @@ struct segdesc {
 #define PTE_D		0x040	// Dirty
 #define PTE_PS		0x080	// Page Size
 #define PTE_MBZ		0x180	// Bits must be zero
+#define PTE_COW		0x200	// Copy-on-write (available for software use)
+
+// Page fault error code flags.
+#define FEC_WR		0x002	// Fault was caused by a write
 
 // Address in page table or page directory entry
 #define PTE_ADDR(pte)	((uint)(pte) & ~0xFFF)
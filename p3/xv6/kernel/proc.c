@@ -85,6 +85,7 @@ userinit(void)
     panic("userinit: out of memory?");
   inituvm(p->pgdir, _binary_initcode_start, (int)_binary_initcode_size);
   p->sz = PGSIZE;
+  p->stlimit = STACKLIMIT;
   memset(p->tf, 0, sizeof(*p->tf)); p->tf->cs = (SEG_UCODE << 3) | DPL_USER; p->tf->ds = (SEG_UDATA << 3) | DPL_USER;
   p->tf->es = p->tf->ds;
   p->tf->ss = p->tf->ds;
@@ -108,9 +109,16 @@ growproc(int n)
   sz = proc->sz;
   stsz = proc->stsz;
   
-  // Make sure heap does not grow into stack (leave unallocated page in between)
-  if (sz+n > stsz-PGSIZE)
-    return -1;
+  // Make sure heap does not grow into stack (leave unallocated page in between).
+  // Stack pages below the stack pointer were only mapped ahead of time by
+  // growstack(), so they can be given back to make room.
+  if (sz+n > stsz-PGSIZE) {
+    stsz = PGROUNDUP(sz+n) + PGSIZE;
+    if (stsz > (uint)PGROUNDDOWN(proc->tf->esp))
+      return -1;
+    deallocuvm(proc->pgdir, stsz, proc->stsz);
+    proc->stsz = stsz;
+  }
 
   if(n > 0){
     if((sz = allocuvm(proc->pgdir, sz, sz + n)) == 0)
@@ -124,6 +132,39 @@ growproc(int n)
   return 0;
 }
 
+// Grow current process's stack down over addr, which it faulted on with
+// its stack pointer at esp. Maps up to STACKCHUNK pages at once so that
+// deep recursion doesn't fault on every page, but never past the stack
+// limit or into the unallocated page above the heap.
+// Return 0 on success, -1 if addr is not a place the stack can grow to.
+int
+growstack(uint addr, uint esp)
+{
+  uint stsz, bottom;
+
+  // Only just below the stack, and not far below the stack pointer
+  // (push and call write at most 32 bytes below it)
+  if (addr >= proc->stsz || addr + 32 < esp)
+    return -1;
+  bottom = (uint)PGROUNDDOWN(addr);
+  if (bottom < USERTOP - proc->stlimit || bottom < PGROUNDUP(proc->sz) + PGSIZE)
+    return -1;
+
+  // Map ahead as far as the limit and the heap allow
+  stsz = proc->stsz - STACKCHUNK*PGSIZE;
+  if (stsz > bottom || stsz > proc->stsz)
+    stsz = bottom;
+  if (stsz < USERTOP - proc->stlimit)
+    stsz = USERTOP - proc->stlimit;
+  if (stsz < PGROUNDUP(proc->sz) + PGSIZE)
+    stsz = PGROUNDUP(proc->sz) + PGSIZE;
+
+  if (allocuvm(proc->pgdir, stsz, proc->stsz) == 0)
+    return -1;
+  proc->stsz = stsz;
+  return 0;
+}
+
 // Create a new process copying p as the parent.
 // Sets up stack to return as if from system call.
 // Caller must set state of returned proc to RUNNABLE.
@@ -146,6 +187,7 @@ fork(void)
   }
   np->sz = proc->sz;
   np->stsz = proc->stsz;
+  np->stlimit = proc->stlimit;
   np->parent = proc;
   *np->tf = *proc->tf;
 
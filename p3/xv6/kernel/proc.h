@@ -63,6 +63,7 @@ enum procstate { UNUSED, EMBRYO, SLEEPING, RUNNABLE, RUNNING, ZOMBIE };
 struct proc {
   uint sz;                     // Size of code and heap (bytes)
   uint stsz;                   // Size of stack (bytes)
+  uint stlimit;                // Most the stack may grow to (bytes)
   pde_t* pgdir;                // Page table
   char *kstack;                // Bottom of kernel stack for this process
   enum procstate state;        // Process state
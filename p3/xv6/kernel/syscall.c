@@ -133,6 +133,7 @@ static int (*syscalls[])(void) = {
 [SYS_wait]    sys_wait,
 [SYS_write]   sys_write,
 [SYS_uptime]  sys_uptime,
+[SYS_stacklimit] sys_stacklimit,
 };
 
 // Called on a syscall trap. Checks that the syscall number (passed via eax)
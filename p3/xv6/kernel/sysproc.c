@@ -76,6 +76,22 @@ sys_sleep(void)
   return 0;
 }
 
+// set the most the stack may grow to, in bytes, if n > 0 and
+// return what it was. A stack already bigger than that is left alone.
+int
+sys_stacklimit(void)
+{
+  int n;
+  uint old;
+
+  if(argint(0, &n) < 0)
+    return -1;
+  old = proc->stlimit;
+  if(n > 0)
+    proc->stlimit = n < USERTOP ? PGROUNDUP(n) : USERTOP;
+  return old;
+}
+
 // return how many clock tick interrupts have occurred
 // since boot.
 int
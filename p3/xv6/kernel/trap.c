@@ -75,21 +75,20 @@ trap(struct trapframe *tf)
     lapiceoi();
     break;
   case T_PGFLT:
+    // A write to a page shared since fork, by the process or by
+    // the kernel on its behalf, gets a copy of the page
+    if(proc != 0 && (tf->err & FEC_WR) && copyonwrite(proc->pgdir, rcr2()) == 0)
+      return;
+
     // The kernel caused a page fault
     if(proc == 0 || (tf->cs&3) == 0) {
       cprintf("Segmentation fault (0x%x)\n", rcr2());
       panic("oops! the kernel caused a segfault");
     } else { 
      
-      // If this is the next page for the stack, allocate it unless it conflicts with heap 
-      uint addr = rcr2();
-      if (addr <= proc->stsz && addr >= proc->stsz-PGSIZE && proc->stsz-PGSIZE*2 > proc->sz) {
-        
-        if((allocuvm(proc->pgdir, proc->stsz-PGSIZE, proc->stsz)) != 0) {
-          proc->stsz -= PGSIZE;
-          return;
-        }
-      }
+      // If this is just below the stack, grow it unless it conflicts with heap
+      if (growstack(rcr2(), tf->esp) == 0)
+        return;
 
       cprintf("Segmentation fault (0x%x)\n", rcr2());
       cprintf("name %s pid %d sz 0x%x stsz 0x%x sp 0x%x\n", proc->name, proc->pid, proc->sz, proc->stsz, proc->tf->esp);
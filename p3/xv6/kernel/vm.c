@@ -157,6 +157,7 @@ vmenable(void)
   switchkvm(); // load kpgdir into cr3
   cr0 = rcr0();
   cr0 |= CR0_PG;
+  cr0 |= CR0_WP;   // so that kernel writes to user memory respect copy-on-write
   lcr0(cr0);
 }
 
@@ -294,52 +295,85 @@ freevm(pde_t *pgdir)
   kfree((char*)pgdir);
 }
 
-// Given a parent process's page table, create a copy
-// of it for a child.
-pde_t*
-copyuvm(pde_t *pgdir, uint sz)
+// Map the user pages from start to end in pgdir into d as
+// well, read-only in both so that the first write to one
+// makes a copy of it (see copyonwrite).
+static int
+sharepages(pde_t *pgdir, pde_t *d, uint start, uint end)
 {
-  pde_t *d; pte_t *pte; uint pa, i;
-  char *mem;
+  pte_t *pte; uint pa, i;
 
-  if((d = setupkvm()) == 0)
-    return 0;
-  
-  // Copy code segment
-  for(i = PGSIZE; i < sz; i += PGSIZE){
+  for(i = start; i < end; i += PGSIZE){
     if((pte = walkpgdir(pgdir, (void*)i, 0)) == 0)
       panic("copyuvm: pte should exist");
     if(!(*pte & PTE_P))
       panic("copyuvm: page not present");
+    if(*pte & PTE_W)
+      *pte = (*pte & ~PTE_W) | PTE_COW;
     pa = PTE_ADDR(*pte);
-    if((mem = kalloc()) == 0)
-      goto bad;
-    memmove(mem, (char*)pa, PGSIZE);
-    if(mappages(d, (void*)i, PGSIZE, PADDR(mem), PTE_W|PTE_U) < 0)
-      goto bad;
+    if(mappages(d, (void*)i, PGSIZE, pa, *pte & (PTE_U|PTE_COW)) < 0)
+      return -1;
+    kref((char*)pa);
   }
+  return 0;
+}
+
+// Given a parent process's page table, create a copy
+// of it for a child. The two share every user page
+// until one of them writes to it.
+pde_t*
+copyuvm(pde_t *pgdir, uint sz)
+{
+  pde_t *d;
+
+  if((d = setupkvm()) == 0)
+    return 0;
   
-  // Copy stack segment
-  for(i = proc->stsz; i < USERTOP; i += PGSIZE){
-    if((pte = walkpgdir(pgdir, (void*)i, 0)) == 0)
-      panic("copyuvm: pte should exist");
-    if(!(*pte & PTE_P))
-      panic("copyuvm: page not present");
-    pa = PTE_ADDR(*pte);
-    if((mem = kalloc()) == 0)
-      goto bad;
-    memmove(mem, (char*)pa, PGSIZE);
-    if(mappages(d, (void*)i, PGSIZE, PADDR(mem), PTE_W|PTE_U) < 0)
-      goto bad;
-  }  
+  // Share code segment and stack segment
+  if(sharepages(pgdir, d, PGSIZE, sz) < 0 ||
+     sharepages(pgdir, d, proc->stsz, USERTOP) < 0)
+    goto bad;
 
+  // The parent's pages just became read-only
+  lcr3(PADDR(pgdir));
   return d;
 
 bad:
+  lcr3(PADDR(pgdir));
   freevm(d);
   return 0;
 }
 
+// Give the current process its own copy of the copy-on-write
+// page at va in its page table pgdir, because it is about to
+// write to it. Returns 0 on success, -1 if va is not in such a
+// page or there is no memory for the copy.
+int
+copyonwrite(pde_t *pgdir, uint va)
+{
+  pte_t *pte;
+  uint pa;
+  char *mem;
+
+  if(va >= USERTOP || (pte = walkpgdir(pgdir, (void*)va, 0)) == 0)
+    return -1;
+  if((*pte & (PTE_P|PTE_U|PTE_COW)) != (PTE_P|PTE_U|PTE_COW))
+    return -1;
+  pa = PTE_ADDR(*pte);
+
+  // If everyone else has made their copy already, this one is ours
+  if(krefs((char*)pa) > 1){
+    if((mem = kalloc()) == 0)
+      return -1;
+    memmove(mem, (char*)pa, PGSIZE);
+    *pte = PADDR(mem) | (*pte & 0xFFF);
+    kfree((char*)pa);
+  }
+  *pte = (*pte & ~PTE_COW) | PTE_W;
+  lcr3(PADDR(pgdir));
+  return 0;
+}
+
 // Map user virtual address to kernel physical address.
 char*
 uva2ka(pde_t *pgdir, char *uva)
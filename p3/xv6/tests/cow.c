@@ -0,0 +1,51 @@
+/* fork shares pages copy-on-write: writes by either side (or by the kernel for them) stay private */
+#include "types.h"
+#include "user.h"
+
+#undef NULL
+#define NULL ((void*)0)
+
+#define assert(x) if (x) {} else { \
+  printf(1, "%s: %d ", __FILE__, __LINE__); \
+  printf(1, "assert failed (%s)\n", # x); \
+  printf(1, "TEST FAILED\n"); \
+  exit(); \
+}
+
+int global = 1;
+char buf[8] = "parent";
+
+int
+main(int argc, char *argv[])
+{
+  int local = 1;
+  int fds[2];
+  int *heap = (int*) sbrk(4096);
+  *heap = 1;
+
+  assert(pipe(fds) == 0);
+  int pid = fork();
+  if(pid == 0) {
+    global = 2;
+    local = 2;
+    *heap = 2;
+    // the kernel writes into the shared page for read()
+    assert(read(fds[0], buf, 6) == 6);
+    assert(global == 2 && local == 2 && *heap == 2);
+    assert(strcmp(buf, "child!") == 0);
+    exit();
+  } else {
+    assert(write(fds[1], "child!", 6) == 6);
+    wait();
+  }
+  assert(global == 1 && local == 1 && *heap == 1);
+  assert(strcmp(buf, "parent") == 0);
+
+  // and the parent can write to them now that they are its own again
+  global = 3;
+  *heap = 3;
+  assert(global == 3 && *heap == 3);
+
+  printf(1, "TEST PASSED\n");
+  exit();
+}
@@ -20,6 +20,7 @@ USER_PROGS := \
 	bounds\
 	bounds2\
 	bounds3\
+	cow\
 	heap\
 	heap2\
 	null\
@@ -28,6 +29,7 @@ USER_PROGS := \
 	stack2\
 	stack3\
 	stack4\
+	stack5\
 	syscalls\
 	usertests
 		
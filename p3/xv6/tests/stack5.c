@@ -0,0 +1,61 @@
+/* stack should grow several pages at a time, but no further than its limit (program must terminate) */
+#include "types.h"
+#include "user.h"
+
+#undef NULL
+#define NULL ((void*)0)
+
+#define PGSIZE 4096
+
+#define assert(x) if (x) {} else { \
+  printf(1, "%s: %d ", __FILE__, __LINE__); \
+  printf(1, "assert failed (%s)\n", # x); \
+  printf(1, "TEST FAILED\n"); \
+  exit(); \
+}
+
+void
+growstack(int n) 
+{
+  char filler[4096];
+  memset(filler, 0, sizeof(filler)); // touch the new page
+  if(n > 1)
+    growstack(n-1);
+}
+
+int
+main(int argc, char *argv[])
+{
+  int ppid = getpid();
+  uint sz = (uint) sbrk(0);
+  uint stackpage = (160 - 1) * PGSIZE;
+  uint guardpage = stackpage - PGSIZE;
+
+  // deep recursion should work fine
+  growstack(32);
+
+  // the pages mapped ahead of the stack pointer make way for the heap
+  assert((int) sbrk(guardpage - sz) != -1);
+  assert((int) sbrk(-1*(guardpage - sz)) != -1);
+
+  // no limit by default, and it can be lowered
+  assert(stacklimit(0) == 160 * PGSIZE);
+  assert(stacklimit(8 * PGSIZE) == 160 * PGSIZE);
+  assert(stacklimit(0) == 8 * PGSIZE);
+
+  // the limit holds for children too
+  int pid = fork();
+  if(pid == 0) {
+    growstack(4);
+    // should fail
+    growstack(16);
+    printf(1, "TEST FAILED\n");
+    kill(ppid);
+    exit();
+  } else {
+    wait();
+  }
+
+  printf(1, "TEST PASSED\n");
+  exit();
+}
@@ -0,0 +1,260 @@
+//
+// cache.c: Cache of the static files we serve, so that a hot file is sent
+// without a stat(), open() or mmap() and without building its header.
+//
+// Entries are spread over CACHE_SHARDS shards by a hash of their path, so
+// workers looking up different files rarely wait on the same lock. Each
+// shard has its own hash table and LRU list, and holds at most its share
+// of CACHE_BYTES and CACHE_FILES; adding to a full shard evicts its least
+// recently used entries.
+//
+// An entry that hasn't been checked for CACHE_TTL seconds is checked with
+// stat() the next time it's found, and dropped if the file changed. One
+// that's dropped or evicted while someone is using it is freed when they
+// put it back.
+//
+
+#include "cache.h"
+
+typedef struct {
+   pthread_mutex_t lock;
+   cache_entry_t *table[CACHE_BUCKETS];
+   cache_entry_t *head, *tail;    // LRU list
+   size_t bytes;
+   int files;
+} shard_t;
+
+static shard_t shards[CACHE_SHARDS];
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+static void cacheInit(void)
+{
+   int i;
+
+   for (i = 0; i < CACHE_SHARDS; i++)
+      pthread_mutex_init(&shards[i].lock, NULL);
+}
+
+static unsigned cacheHash(char *path)
+{
+   unsigned h = 5381;
+
+   while (*path)
+      h = h * 33 + (unsigned char)*path++;
+   return h;
+}
+
+static cache_entry_t **cacheBucket(shard_t *s, unsigned hash)
+{
+   return &s->table[(hash / CACHE_SHARDS) % CACHE_BUCKETS];
+}
+
+//
+// How much of the shard's memory e takes up
+//
+static size_t cacheBytes(cache_entry_t *e)
+{
+   return e->headerlen[0] + e->headerlen[1] + (e->fd < 0 ? e->size : 0);
+}
+
+static void cacheFree(cache_entry_t *e)
+{
+   if (e->fd >= 0)
+      Close(e->fd);
+   free(e->body);
+   free(e->header[0]);
+   free(e->header[1]);
+   free(e->path);
+   free(e);
+}
+
+static cache_entry_t *cacheFind(shard_t *s, char *path, unsigned hash)
+{
+   cache_entry_t *e;
+
+   for (e = *cacheBucket(s, hash); e != NULL; e = e->hnext) {
+      if (e->hash == hash && !strcmp(e->path, path))
+         return e;
+   }
+   return NULL;
+}
+
+static void cacheLink(shard_t *s, cache_entry_t *e)
+{
+   e->prev = NULL;
+   e->next = s->head;
+   if (s->head != NULL)
+      s->head->prev = e;
+   else
+      s->tail = e;
+   s->head = e;
+}
+
+static void cacheUnlinkLRU(shard_t *s, cache_entry_t *e)
+{
+   if (e->prev != NULL)
+      e->prev->next = e->next;
+   else
+      s->head = e->next;
+   if (e->next != NULL)
+      e->next->prev = e->prev;
+   else
+      s->tail = e->prev;
+}
+
+//
+// Take e out of the shard, which drops the table's reference to it
+//
+static void cacheRemove(shard_t *s, cache_entry_t *e)
+{
+   cache_entry_t **pp;
+
+   for (pp = cacheBucket(s, e->hash); *pp != e; pp = &(*pp)->hnext)
+      ;
+   *pp = e->hnext;
+   cacheUnlinkLRU(s, e);
+   s->bytes -= cacheBytes(e);
+   s->files--;
+   if (--e->refs == 0)
+      cacheFree(e);
+}
+
+//
+// Has the file changed since we cached it?
+//
+static int cacheStale(cache_entry_t *e)
+{
+   struct stat sbuf;
+
+   if (stat(e->path, &sbuf) < 0)
+      return 1;
+   return sbuf.st_dev != e->dev || sbuf.st_ino != e->ino ||
+      sbuf.st_mode != e->mode || sbuf.st_size != e->size ||
+      sbuf.st_mtim.tv_sec != e->mtime.tv_sec ||
+      sbuf.st_mtim.tv_nsec != e->mtime.tv_nsec;
+}
+
+//
+// Look up path. Returns its entry, which the caller has to put back with
+// cachePut(), or NULL if it isn't cached (any more).
+//
+cache_entry_t *cacheGet(char *path)
+{
+   unsigned hash = cacheHash(path);
+   shard_t *s = &shards[hash % CACHE_SHARDS];
+   cache_entry_t *e;
+   time_t now;
+   int check = 0;
+
+   pthread_once(&once, cacheInit);
+
+   pthread_mutex_lock(&s->lock);
+   if ((e = cacheFind(s, path, hash)) != NULL) {
+      cacheUnlinkLRU(s, e);
+      cacheLink(s, e);
+      e->refs++;
+      now = time(NULL);
+      if (now - e->checked >= CACHE_TTL) {
+         e->checked = now;
+         check = 1;
+      }
+   }
+   pthread_mutex_unlock(&s->lock);
+
+   // Check the file without holding up the shard
+   if (check && cacheStale(e)) {
+      pthread_mutex_lock(&s->lock);
+      if (cacheFind(s, path, hash) == e)
+         cacheRemove(s, e);
+      pthread_mutex_unlock(&s->lock);
+      cachePut(e);
+      return NULL;
+   }
+   return e;
+}
+
+//
+// Cache the file open at fd, which sbuf describes, with its response
+// headers. It's read into memory if it is small, and kept open if not.
+// Returns the new entry, which the caller has to put back with cachePut(),
+// or NULL if it couldn't be cached.
+//
+cache_entry_t *cacheAdd(char *path, int fd, struct stat *sbuf, char *header[2])
+{
+   unsigned hash = cacheHash(path);
+   shard_t *s = &shards[hash % CACHE_SHARDS];
+   cache_entry_t *e, *old;
+   ssize_t n;
+   off_t done;
+   int i;
+
+   pthread_once(&once, cacheInit);
+
+   if ((e = calloc(1, sizeof(cache_entry_t))) == NULL)
+      return NULL;
+   e->fd = -1;
+   e->size = sbuf->st_size;
+   if (e->size <= CACHE_SMALL) {
+      if ((e->body = malloc(e->size + 1)) == NULL) {
+         cacheFree(e);
+         return NULL;
+      }
+      for (done = 0; done < e->size; done += n) {
+         n = pread(fd, e->body + done, e->size - done, done);
+         if (n < 0 && errno == EINTR) {
+            n = 0;
+            continue;
+         }
+         if (n <= 0) {
+            // It got shorter, or we can't read it
+            cacheFree(e);
+            return NULL;
+         }
+      }
+   } else if ((e->fd = fcntl(fd, F_DUPFD_CLOEXEC, 0)) < 0) {
+      cacheFree(e);
+      return NULL;
+   }
+   e->path = strdup(path);
+   for (i = 0; i < 2; i++) {
+      e->header[i] = strdup(header[i]);
+      e->headerlen[i] = strlen(header[i]);
+   }
+   if (e->path == NULL || e->header[0] == NULL || e->header[1] == NULL) {
+      cacheFree(e);
+      return NULL;
+   }
+   e->dev = sbuf->st_dev;
+   e->ino = sbuf->st_ino;
+   e->mode = sbuf->st_mode;
+   e->mtime = sbuf->st_mtim;
+   e->checked = time(NULL);
+   e->refs = 2;
+   e->hash = hash;
+
+   pthread_mutex_lock(&s->lock);
+   if ((old = cacheFind(s, path, hash)) != NULL)
+      cacheRemove(s, old);
+   e->hnext = *cacheBucket(s, hash);
+   *cacheBucket(s, hash) = e;
+   cacheLink(s, e);
+   s->bytes += cacheBytes(e);
+   s->files++;
+   while (s->tail != e && (s->bytes > CACHE_BYTES / CACHE_SHARDS ||
+                           s->files > CACHE_FILES / CACHE_SHARDS))
+      cacheRemove(s, s->tail);
+   pthread_mutex_unlock(&s->lock);
+   return e;
+}
+
+void cachePut(cache_entry_t *e)
+{
+   shard_t *s = &shards[e->hash % CACHE_SHARDS];
+   int last;
+
+   pthread_mutex_lock(&s->lock);
+   last = --e->refs == 0;
+   pthread_mutex_unlock(&s->lock);
+   if (last)
+      cacheFree(e);
+}
@@ -0,0 +1,39 @@
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
+#include "cs537.h"
+
+#define CACHE_SHARDS 16           // locked separately
+#define CACHE_BUCKETS 256         // hash chains per shard
+#define CACHE_BYTES (64 << 20)    // at most this much file data in memory
+#define CACHE_FILES 1024          // and at most this many entries
+#define CACHE_SMALL (64 << 10)    // files up to this size are kept in memory
+#define CACHE_TTL 1               // seconds before an entry is checked again
+
+//
+// A static file we've served before: its response headers, and either its
+// contents (if it's small) or a descriptor we keep open for it
+//
+typedef struct cache_entry {
+   char *path;
+   char *header[2];    // the response header, without and with keep-alive
+   size_t headerlen[2];
+   char *body;         // the whole file, or NULL if it's too big
+   int fd;             // otherwise the open file (-1 if it's in body)
+   off_t size;
+   dev_t dev;          // what the file was when we read it
+   ino_t ino;
+   mode_t mode;
+   struct timespec mtime;
+   time_t checked;     // when we last made sure it hadn't changed
+   int refs;           // one for the table, one for each user
+   unsigned hash;
+   struct cache_entry *hnext;             // hash chain
+   struct cache_entry *prev, *next;       // LRU list, most recent first
+} cache_entry_t;
+
+cache_entry_t *cacheGet(char *path);
+cache_entry_t *cacheAdd(char *path, int fd, struct stat *sbuf, char *header[2]);
+void cachePut(cache_entry_t *e);
+
+#endif
@@ -0,0 +1,356 @@
+//
+// cgi.c: Running CGI programs.
+//
+// A program named with server -c is kept running between requests, and
+// has to speak the protocol in cgilib.h. Each such program has a pool of
+// up to CGI_PROCS processes, started on demand and reused. A request goes
+// to an idle process as a frame, and its output comes back in frames that
+// we write to the client. So there is no fork() per request, and a worker
+// that's waiting for output can give up on a process that takes too long.
+// If one doesn't say it's ready within CGI_START seconds, it's started for
+// each request instead, until the program changes.
+//
+// Any other program is started for each request with posix_spawn(), and
+// writes to the client itself, as before. It's never run just to see
+// whether it speaks the protocol, since that could have side effects. We
+// only reap our own child, so the other workers' children are left alone.
+//
+
+#include <poll.h>
+#include <spawn.h>
+#include "cgi.h"
+#include "cgilib.h"
+
+extern char **environ;
+
+typedef struct {
+   pid_t pid;
+   int fd;                  // our end of its socket
+   struct timespec mtime;   // of the program it runs
+} cgi_proc_t;
+
+typedef struct cgi_pool {
+   char *path;
+   pthread_mutex_t lock;
+   pthread_cond_t idle;     // a process was put back, or stopped
+   cgi_proc_t procs[CGI_PROCS];   // the idle ones
+   int nidle;
+   int nprocs;              // how many are running, idle or not
+   int unpooled;            // the program doesn't speak the protocol
+   struct timespec mtime;   // of the program, when we last looked
+   struct cgi_pool *next;
+} cgi_pool_t;
+
+// Only added to before the server takes requests, so it's read unlocked
+static cgi_pool_t *pools;
+
+//
+// A copy of the environment, with name set to value
+//
+static char **cgiEnv(char *name, char *value)
+{
+   size_t len = strlen(name);
+   char **envp;
+   int n, i, j;
+
+   for (n = 0; environ[n] != NULL; n++)
+      ;
+   if ((envp = malloc((n + 2) * sizeof(char *))) == NULL)
+      return NULL;
+   for (i = j = 0; i < n; i++) {
+      if (strncmp(environ[i], name, len) || environ[i][len] != '=')
+         envp[j++] = environ[i];
+   }
+   if ((envp[j] = malloc(len + strlen(value) + 2)) == NULL) {
+      free(envp);
+      return NULL;
+   }
+   sprintf(envp[j], "%s=%s", name, value);
+   envp[j + 1] = NULL;
+   return envp;
+}
+
+static void cgiEnvFree(char **envp)
+{
+   int n;
+
+   for (n = 0; envp[n] != NULL; n++)
+      ;
+   free(envp[n - 1]);
+   free(envp);
+}
+
+//
+// Keep the CGI program at path running between requests. path is as in a
+// URL (/output.cgi), or relative to the server's directory. Returns 0, or
+// -1 if there's no memory. Must be called before any requests come in.
+//
+int cgiPoolAdd(char *path)
+{
+   cgi_pool_t *p;
+
+   if ((p = calloc(1, sizeof(cgi_pool_t))) == NULL)
+      return -1;
+   // Make it look like the file names requestParseURI() makes
+   if ((p->path = malloc(strlen(path) + 3)) == NULL) {
+      free(p);
+      return -1;
+   }
+   sprintf(p->path, "%s%s", path[0] == '/' ? "." : strncmp(path, "./", 2) ? "./" : "", path);
+   pthread_mutex_init(&p->lock, NULL);
+   pthread_cond_init(&p->idle, NULL);
+   p->next = pools;
+   pools = p;
+   return 0;
+}
+
+//
+// The pool for the program at path, or NULL if it isn't kept running
+//
+static cgi_pool_t *cgiPool(char *path)
+{
+   cgi_pool_t *p;
+
+   for (p = pools; p != NULL; p = p->next) {
+      if (!strcmp(p->path, path))
+         break;
+   }
+   return p;
+}
+
+static void cgiStop(cgi_proc_t *proc)
+{
+   Close(proc->fd);
+   kill(proc->pid, SIGKILL);
+   while (waitpid(proc->pid, NULL, 0) < 0 && errno == EINTR)
+      ;
+}
+
+//
+// Wait up to secs seconds for a frame from proc. Returns its length, or
+// -1 if none came.
+//
+static ssize_t cgiRecv(cgi_proc_t *proc, char *frame, int secs)
+{
+   struct pollfd pfd = { proc->fd, POLLIN, 0 };
+   int rc;
+
+   while ((rc = poll(&pfd, 1, secs * 1000)) < 0 && errno == EINTR)
+      ;
+   if (rc <= 0)
+      return -1;
+   return recv(proc->fd, frame, CGI_FRAME + 1, 0);
+}
+
+//
+// Start a process for p. Returns 0 once it says it's ready, 1 if it
+// started but doesn't speak the protocol, or -1 if it couldn't start.
+//
+static int cgiStart(cgi_pool_t *p, cgi_proc_t *proc)
+{
+   posix_spawn_file_actions_t fa;
+   char *argv[] = { p->path, NULL }, **envp, fd[16], frame[CGI_FRAME + 1];
+   int sv[2], rc;
+
+   if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0)
+      return -1;
+   sprintf(fd, "%d", CGI_POOL_FD);
+   if ((envp = cgiEnv(CGI_POOL_ENV, fd)) == NULL) {
+      Close(sv[0]);
+      Close(sv[1]);
+      return -1;
+   }
+   posix_spawn_file_actions_init(&fa);
+   posix_spawn_file_actions_adddup2(&fa, sv[1], CGI_POOL_FD);
+   posix_spawn_file_actions_addopen(&fa, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+   posix_spawn_file_actions_addopen(&fa, STDOUT_FILENO, "/dev/null", O_WRONLY, 0);
+   rc = posix_spawn(&proc->pid, p->path, &fa, NULL, argv, envp);
+   posix_spawn_file_actions_destroy(&fa);
+   cgiEnvFree(envp);
+   Close(sv[1]);
+   if (rc != 0) {
+      Close(sv[0]);
+      return -1;
+   }
+
+   proc->fd = sv[0];
+   if (cgiRecv(proc, frame, CGI_START) < 1 || frame[0] != CGI_READY) {
+      cgiStop(proc);
+      return 1;
+   }
+   return 0;
+}
+
+//
+// Get an idle process for p, starting one if there's room. Returns
+// CGI_DONE with it in proc, CGI_BUSY if none was free in time, or -1 if
+// the program can't be pooled.
+//
+static int cgiGet(cgi_pool_t *p, cgi_proc_t *proc)
+{
+   struct timespec deadline;
+   struct stat sbuf;
+   int rc;
+
+   if (stat(p->path, &sbuf) < 0)
+      return -1;
+   clock_gettime(CLOCK_REALTIME, &deadline);
+   deadline.tv_sec += CGI_WAIT;
+
+   pthread_mutex_lock(&p->lock);
+   // The program changed: stop the processes running the old one
+   if (sbuf.st_mtim.tv_sec != p->mtime.tv_sec || sbuf.st_mtim.tv_nsec != p->mtime.tv_nsec) {
+      while (p->nidle > 0) {
+         cgiStop(&p->procs[--p->nidle]);
+         p->nprocs--;
+      }
+      p->mtime = sbuf.st_mtim;
+      p->unpooled = 0;
+   }
+   while (1) {
+      if (p->unpooled) {
+         rc = -1;
+         break;
+      }
+      if (p->nidle > 0) {
+         *proc = p->procs[--p->nidle];
+         rc = CGI_DONE;
+         break;
+      }
+      if (p->nprocs < CGI_PROCS) {
+         p->nprocs++;
+         proc->mtime = p->mtime;
+         pthread_mutex_unlock(&p->lock);
+         rc = cgiStart(p, proc);
+         pthread_mutex_lock(&p->lock);
+         if (rc == 0)
+            break;
+         p->nprocs--;
+         if (rc > 0)
+            p->unpooled = 1;
+         pthread_cond_broadcast(&p->idle);
+         rc = -1;
+         break;
+      }
+      if (pthread_cond_timedwait(&p->idle, &p->lock, &deadline) == ETIMEDOUT) {
+         rc = CGI_BUSY;
+         break;
+      }
+   }
+   pthread_mutex_unlock(&p->lock);
+   return rc;
+}
+
+//
+// Give proc back to p, or stop it if it's broken or runs an old program
+//
+static void cgiPut(cgi_pool_t *p, cgi_proc_t *proc, int ok)
+{
+   pthread_mutex_lock(&p->lock);
+   if (ok && proc->mtime.tv_sec == p->mtime.tv_sec && proc->mtime.tv_nsec == p->mtime.tv_nsec) {
+      p->procs[p->nidle++] = *proc;
+   } else {
+      cgiStop(proc);
+      p->nprocs--;
+   }
+   pthread_cond_signal(&p->idle);
+   pthread_mutex_unlock(&p->lock);
+}
+
+//
+// Run one request on proc, writing its output to c after header. Returns
+// 0 if it went fine, or -1 if the process broke (and sets *started if it
+// did so after taking the request).
+//
+static int cgiRequest(conn_t *c, cgi_proc_t *proc, char *cgiargs, char *header, int *started)
+{
+   char frame[CGI_FRAME + 1];
+   size_t len = strlen(cgiargs);
+   ssize_t n;
+   int nonblock = c->nonblock;
+
+   *started = 0;
+   if (len > CGI_FRAME - 1)
+      len = CGI_FRAME - 1;
+   frame[0] = CGI_REQUEST;
+   memcpy(frame + 1, cgiargs, len);
+   if (send(proc->fd, frame, len + 1, MSG_NOSIGNAL) != len + 1)
+      return -1;
+
+   *started = 1;
+   connWrite(c, header, strlen(header));
+   while ((n = cgiRecv(proc, frame, CGI_TIMEOUT)) > 0 && frame[0] == CGI_DATA) {
+      // Don't keep much more for a slow client than a blocking write would
+      if (c->nonblock && c->outlen - c->outpos > CGI_BUFMAX)
+         connBlocking(c, 1);
+      connWrite(c, frame + 1, n - 1);
+   }
+   if (nonblock && !c->nonblock)
+      connBlocking(c, 0);
+   return n > 0 && frame[0] == CGI_END ? 0 : -1;
+}
+
+//
+// Start filename for just this request, and let it write to the client
+//
+static int cgiSpawn(conn_t *c, char *filename, char *cgiargs, char *header)
+{
+   posix_spawn_file_actions_t fa;
+   char *argv[] = { filename, NULL }, **envp;
+   int nonblock = c->nonblock;
+   pid_t pid;
+
+   connWrite(c, header, strlen(header));
+   if ((envp = cgiEnv("QUERY_STRING", cgiargs)) == NULL)
+      return CGI_DONE;
+
+   // The CGI program writes to the socket itself, and expects it to block
+   if (nonblock)
+      connBlocking(c, 1);
+
+   posix_spawn_file_actions_init(&fa);
+   /* When the CGI process writes to stdout, it will instead go to the socket */
+   posix_spawn_file_actions_adddup2(&fa, c->fd, STDOUT_FILENO);
+   if (posix_spawn(&pid, filename, &fa, NULL, argv, envp) == 0) {
+      while (waitpid(pid, NULL, 0) < 0 && errno == EINTR)
+         ;
+   }
+   posix_spawn_file_actions_destroy(&fa);
+   cgiEnvFree(envp);
+
+   if (nonblock)
+      connBlocking(c, 0);
+   return CGI_DONE;
+}
+
+//
+// Run the CGI program filename with the query string cgiargs, and write
+// header and then its output to c. Returns CGI_DONE, or CGI_BUSY if it
+// didn't run because it has too many requests already (nothing is
+// written then).
+//
+int cgiRun(conn_t *c, char *filename, char *cgiargs, char *header)
+{
+   cgi_pool_t *p;
+   cgi_proc_t proc;
+   int tries, started, rc;
+
+   if ((p = cgiPool(filename)) == NULL)
+      return cgiSpawn(c, filename, cgiargs, header);
+
+   // A process that was idle may have died since; try one more
+   for (tries = 0; tries < 2; tries++) {
+      if ((rc = cgiGet(p, &proc)) < 0)
+         return cgiSpawn(c, filename, cgiargs, header);
+      if (rc == CGI_BUSY)
+         return CGI_BUSY;
+      rc = cgiRequest(c, &proc, cgiargs, header, &started);
+      cgiPut(p, &proc, rc == 0);
+      if (rc == 0)
+         return CGI_DONE;
+      // If its output was cut short, the connection closes after it anyway
+      if (started)
+         return CGI_DONE;
+   }
+   return cgiSpawn(c, filename, cgiargs, header);
+}
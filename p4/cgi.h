@@ -0,0 +1,18 @@
+#ifndef __CGI_H__
+#define __CGI_H__
+
+#include "conn.h"
+
+#define CGI_PROCS 8            // warm processes per program, at most
+#define CGI_WAIT 5             // seconds a request waits for one to be free
+#define CGI_START 2            // seconds a new one has to say it's ready
+#define CGI_TIMEOUT 60         // seconds one may go without any output
+#define CGI_BUFMAX (1 << 20)   // output kept for a client that's behind
+
+#define CGI_DONE 0
+#define CGI_BUSY 1             // every process was busy for CGI_WAIT seconds
+
+int cgiPoolAdd(char *path);
+int cgiRun(conn_t *c, char *filename, char *cgiargs, char *header);
+
+#endif
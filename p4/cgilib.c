@@ -0,0 +1,70 @@
+//
+// cgilib.c: The CGI program's side of the pool protocol (see cgilib.h).
+// It sends everything written to stdout as CGI_DATA frames.
+//
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include "cgilib.h"
+
+static int sock = -1;   // to the server, if it keeps us running
+static int requests = 0;
+
+static ssize_t cgiWrite(void *cookie, const char *buf, size_t size)
+{
+   char frame[CGI_FRAME + 1];
+   size_t n, done;
+
+   for (done = 0; done < size; done += n) {
+      n = size - done < CGI_FRAME ? size - done : CGI_FRAME;
+      frame[0] = CGI_DATA;
+      memcpy(frame + 1, buf + done, n);
+      if (send(sock, frame, n + 1, MSG_NOSIGNAL) < 0)
+         return -1;
+   }
+   return size;
+}
+
+static int cgiSend(char type)
+{
+   return send(sock, &type, 1, MSG_NOSIGNAL) == 1;
+}
+
+//
+// Wait for the next request, and make it the one QUERY_STRING and stdout
+// are for. Returns 0 once there are no more.
+//
+int cgiAccept(void)
+{
+   cookie_io_functions_t io = { NULL, cgiWrite, NULL, NULL };
+   char frame[CGI_FRAME + 1], *fd;
+   ssize_t n;
+
+   if (requests++ == 0) {
+      // Started for just this request
+      if ((fd = getenv(CGI_POOL_ENV)) == NULL)
+         return 1;
+      sock = atoi(fd);
+      if ((stdout = fopencookie(NULL, "w", io)) == NULL)
+         return 0;
+      setvbuf(stdout, NULL, _IOFBF, CGI_FRAME);
+      if (!cgiSend(CGI_READY))
+         return 0;
+   } else if (sock < 0) {
+      return 0;
+   } else {
+      // Finish the last one
+      fflush(stdout);
+      if (!cgiSend(CGI_END))
+         return 0;
+   }
+
+   if ((n = recv(sock, frame, CGI_FRAME, 0)) <= 0 || frame[0] != CGI_REQUEST)
+      return 0;
+   frame[n] = '\0';
+   setenv("QUERY_STRING", frame + 1, 1);
+   return 1;
+}
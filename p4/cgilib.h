@@ -0,0 +1,36 @@
+#ifndef __CGILIB_H__
+#define __CGILIB_H__
+
+//
+// Lets a CGI program stay running and serve one request after another.
+//
+// The server only does this for programs it's told to (with server -c).
+// It starts such a program with CGI_POOL_FD set in its environment, naming
+// a SOCK_SEQPACKET socket. Every message on the
+// socket is a frame: a type byte, then up to CGI_FRAME bytes.
+//   CGI_READY    program to server, once it has started
+//   CGI_REQUEST  server to program: a request, with its query string
+//   CGI_DATA     program to server: some of the output
+//   CGI_END      program to server: the output is all there
+//
+// A program does this by calling cgiAccept() until it returns 0:
+//
+//   while (cgiAccept()) {
+//      ... read QUERY_STRING, write the output to stdout ...
+//   }
+//
+// Started the usual way (without CGI_POOL_FD), it serves one request.
+//
+
+#define CGI_POOL_ENV "CGI_POOL_FD"
+#define CGI_POOL_FD 3
+#define CGI_FRAME 65536
+
+#define CGI_READY 'R'
+#define CGI_REQUEST 'Q'
+#define CGI_DATA 'D'
+#define CGI_END 'E'
+
+int cgiAccept(void);
+
+#endif
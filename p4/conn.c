@@ -0,0 +1,327 @@
+//
+// conn.c: Writing responses to a client connection, blocking or not.
+//
+
+#include <sys/sendfile.h>
+#include "conn.h"
+
+void connInit(conn_t *c, int fd, int nonblock)
+{
+   c->fd = fd;
+   c->nonblock = nonblock;
+   c->error = 0;
+   c->keepalive = 0;
+   c->requests = 0;
+   c->state = 0;
+   c->deadline = 0;
+   c->client = 0;
+   Rio_readinitb(&c->rio, fd);
+   httpInit(&c->req);
+   c->status = 0;
+   c->length = -1;
+   c->out = NULL;
+   c->outpos = c->outlen = c->outsize = 0;
+   c->map = NULL;
+   c->mappos = c->maplen = 0;
+   c->file = -1;
+   c->filepos = c->filelen = 0;
+}
+
+//
+// Read what the client sent into the space after the unread bytes in
+// c->rio, moving them to the front first. Returns how many bytes were
+// read, 0 if the client closed the connection, or -1 on an error
+// (including EAGAIN, and a timeout on a blocking socket).
+//
+ssize_t connFill(conn_t *c)
+{
+   rio_t *rp = &c->rio;
+   ssize_t n;
+
+   if (rp->rio_bufptr != rp->rio_buf) {
+      memmove(rp->rio_buf, rp->rio_bufptr, rp->rio_cnt);
+      rp->rio_bufptr = rp->rio_buf;
+   }
+   while ((n = read(c->fd, rp->rio_buf + rp->rio_cnt, RIO_BUFSIZE - rp->rio_cnt)) < 0 && errno == EINTR)
+      ;
+   if (n > 0)
+      rp->rio_cnt += n;
+   return n;
+}
+
+//
+// Write as much of iov as the socket takes (all of it, if it blocks).
+// Returns how many bytes that was, or -1 if the connection is broken.
+// With more set, the socket holds on to a short last segment, so that it
+// goes out in one packet with what follows. Empty buffers are skipped, so
+// there's no system call at all if they're all empty.
+//
+static ssize_t connSend(conn_t *c, struct iovec *iov, int iovcnt, int more)
+{
+   struct msghdr msg;
+   ssize_t n, total = 0;
+
+   while (iovcnt > 0 && iov->iov_len == 0) {
+      iov++;
+      iovcnt--;
+   }
+   memset(&msg, 0, sizeof(msg));
+   while (iovcnt > 0) {
+      msg.msg_iov = iov;
+      msg.msg_iovlen = iovcnt;
+      n = sendmsg(c->fd, &msg, more ? MSG_MORE : 0);
+      if (n < 0) {
+         if (errno == EINTR)
+            continue;
+         if (errno == EAGAIN || errno == EWOULDBLOCK)
+            break;
+         return -1;
+      }
+      total += n;
+
+      // Skip past what was written, and any empty buffers after it
+      while (iovcnt > 0 && n >= iov->iov_len) {
+         n -= iov->iov_len;
+         iov++;
+         iovcnt--;
+      }
+      if (iovcnt > 0) {
+         iov->iov_base = (char *)iov->iov_base + n;
+         iov->iov_len -= n;
+      }
+   }
+   return total;
+}
+
+//
+// Forget the rest of the response, because the client is gone
+//
+static void connDrop(conn_t *c)
+{
+   c->error = 1;
+   c->outpos = c->outlen = 0;
+   if (c->map != NULL) {
+      Munmap(c->map, c->maplen);
+      c->map = NULL;
+   }
+   if (c->file >= 0) {
+      Close(c->file);
+      c->file = -1;
+   }
+}
+
+//
+// Send the file with sendfile(), or with mmap() if this file system
+// can't. Returns -1 if the connection is broken.
+//
+static int connSendFile(conn_t *c)
+{
+   ssize_t n;
+
+   while (c->filepos < c->filelen) {
+      n = sendfile(c->fd, c->file, &c->filepos, c->filelen - c->filepos);
+      if (n < 0 && errno == EINTR)
+         continue;
+      if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+         return 0;
+      if (n < 0 && (errno == EINVAL || errno == ENOSYS) && c->filepos == 0) {
+         c->map = Mmap(0, c->filelen, PROT_READ, MAP_PRIVATE, c->file, 0);
+         c->mappos = 0;
+         c->maplen = c->filelen;
+         break;
+      }
+      if (n <= 0)
+         return -1;  // broken, or the file got shorter
+   }
+   Close(c->file);
+   c->file = -1;
+   c->filepos = c->filelen = 0;
+   return 0;
+}
+
+//
+// Keep n bytes at buf to write after what's already pending
+//
+static void connKeep(conn_t *c, char *buf, size_t n)
+{
+   char *out;
+   size_t size;
+
+   if (c->outlen + n > c->outsize && c->outpos > 0) {
+      memmove(c->out, c->out + c->outpos, c->outlen - c->outpos);
+      c->outlen -= c->outpos;
+      c->outpos = 0;
+   }
+   if (c->outlen + n > c->outsize) {
+      size = c->outsize ? c->outsize * 2 : MAXBUF;
+      while (size < c->outlen + n)
+         size *= 2;
+      if ((out = realloc(c->out, size)) == NULL) {
+         connDrop(c);
+         return;
+      }
+      c->out = out;
+      c->outsize = size;
+   }
+   memcpy(c->out + c->outlen, buf, n);
+   c->outlen += n;
+}
+
+void connWrite(conn_t *c, void *buf, size_t n)
+{
+   struct iovec iov;
+
+   iov.iov_base = buf;
+   iov.iov_len = n;
+   connWritev(c, &iov, 1);
+}
+
+//
+// Write the iovcnt buffers in iov, with a single system call if the
+// socket takes them all
+//
+void connWritev(conn_t *c, struct iovec *iov, int iovcnt)
+{
+   struct iovec v[CONN_IOVMAX];
+   ssize_t done = 0;
+   int i;
+
+   if (c->error)
+      return;
+   if (c->map != NULL || c->file >= 0)
+      app_error("connWrite error: the file has to go last");
+   if (iovcnt > CONN_IOVMAX)
+      app_error("connWritev error: too many buffers");
+
+   if (!connPending(c)) {
+      memcpy(v, iov, iovcnt * sizeof(struct iovec));
+      if ((done = connSend(c, v, iovcnt, 0)) < 0) {
+         connDrop(c);
+         return;
+      }
+   }
+
+   // Keep whatever it didn't take
+   for (i = 0; i < iovcnt; i++) {
+      if (done < iov[i].iov_len)
+         connKeep(c, (char *)iov[i].iov_base + done, iov[i].iov_len - done);
+      done = done > iov[i].iov_len ? done - iov[i].iov_len : 0;
+   }
+}
+
+//
+// Write the headerlen bytes at header, then the n bytes mapped at map, and
+// unmap them once they're written. Both go in the same system call.
+//
+void connWriteMap(conn_t *c, void *header, size_t headerlen, char *map, size_t n)
+{
+   if (c->error) {
+      Munmap(map, n);
+      return;
+   }
+   if (c->map != NULL || c->file >= 0)
+      app_error("connWriteMap error: a file is already pending");
+
+   c->map = map;
+   c->mappos = 0;
+   c->maplen = n;
+   connKeep(c, header, headerlen);
+   connFlush(c);
+}
+
+//
+// Write the headerlen bytes at header, then the first n bytes of the open
+// file fd, and close it once they're written. The header is kept rather
+// than sent, so that connFlush() sends it with MSG_MORE and it shares a
+// packet with the start of the file.
+//
+void connWriteFile(conn_t *c, void *header, size_t headerlen, int fd, off_t n)
+{
+   if (c->error) {
+      Close(fd);
+      return;
+   }
+   if (c->map != NULL || c->file >= 0)
+      app_error("connWriteFile error: a file is already pending");
+
+   c->file = fd;
+   c->filepos = 0;
+   c->filelen = n;
+   connKeep(c, header, headerlen);
+   connFlush(c);
+}
+
+int connPending(conn_t *c)
+{
+   return c->outpos < c->outlen || c->map != NULL || c->file >= 0;
+}
+
+//
+// Write what's pending. Returns 1 once nothing is left (or the client is
+// gone and it was dropped), 0 if the socket can't take the rest yet.
+//
+int connFlush(conn_t *c)
+{
+   struct iovec iov[2];
+   ssize_t n;
+
+   iov[0].iov_base = c->out + c->outpos;
+   iov[0].iov_len = c->outlen - c->outpos;
+   iov[1].iov_base = c->map + c->mappos;
+   iov[1].iov_len = c->maplen - c->mappos;
+   if ((n = connSend(c, iov, 2, c->file >= 0)) < 0) {
+      connDrop(c);
+      return 1;
+   }
+
+   if (n >= c->outlen - c->outpos) {
+      n -= c->outlen - c->outpos;
+      c->outpos = c->outlen = 0;
+      c->mappos += n;
+   } else {
+      c->outpos += n;
+   }
+   if (c->map != NULL && c->mappos == c->maplen) {
+      Munmap(c->map, c->maplen);
+      c->map = NULL;
+      c->mappos = c->maplen = 0;
+   }
+
+   if (c->file >= 0 && c->outpos == c->outlen) {
+      if (connSendFile(c) < 0) {
+         connDrop(c);
+         return 1;
+      }
+      // It fell back to mmap
+      if (c->map != NULL)
+         return connFlush(c);
+   }
+   return !connPending(c);
+}
+
+//
+// Switch the socket between blocking and non-blocking mode. Anything
+// pending is written out first when it starts blocking, so that others
+// (such as a CGI program) can write to it directly.
+//
+void connBlocking(conn_t *c, int blocking)
+{
+   int flags = fcntl(c->fd, F_GETFL);
+
+   if (blocking)
+      fcntl(c->fd, F_SETFL, flags & ~O_NONBLOCK);
+   else
+      fcntl(c->fd, F_SETFL, flags | O_NONBLOCK);
+   c->nonblock = !blocking;
+   if (blocking)
+      connFlush(c);
+}
+
+void connFree(conn_t *c)
+{
+   if (c->map != NULL)
+      Munmap(c->map, c->maplen);
+   if (c->file >= 0)
+      Close(c->file);
+   free(c->out);
+}
@@ -0,0 +1,52 @@
+#ifndef __CONN_H__
+#define __CONN_H__
+
+#include <sys/uio.h>
+#include "cs537.h"
+#include "http.h"
+
+//
+// A client connection: the bytes read from it so far, and whatever part
+// of the response it couldn't take yet. In non-blocking mode connWrite(),
+// connWriteMap() and connWriteFile() keep what the socket won't take right
+// away, and connFlush() writes it once the socket has room again.
+//
+#define CONN_IOVMAX 8       // most buffers connWritev() takes at once
+
+typedef struct {
+   int fd;
+   int nonblock;       // fd is in non-blocking mode
+   int error;          // a write failed, so the rest of the response is dropped
+   int keepalive;      // the connection stays open after this response
+   int requests;       // how many more requests it may make
+   int state;          // where it is in event.c
+   time_t deadline;    // when it's closed if no request comes (event.c)
+   unsigned client;    // the client's IP address (event.c)
+   rio_t rio;          // request bytes read from the client
+   http_req_t req;     // the next request in them, as far as it's parsed
+   int status;         // the response to the last one, for the access log
+   off_t length;       // and how long its body is (-1 if we can't tell)
+   char *out;          // response bytes not written yet
+   size_t outpos;
+   size_t outlen;
+   size_t outsize;
+   char *map;          // mmap'd file to write after them (it always goes last)
+   size_t mappos;
+   size_t maplen;
+   int file;           // or a file to sendfile() after them (-1 if none)
+   off_t filepos;
+   off_t filelen;
+} conn_t;
+
+void connInit(conn_t *c, int fd, int nonblock);
+ssize_t connFill(conn_t *c);
+void connWrite(conn_t *c, void *buf, size_t n);
+void connWritev(conn_t *c, struct iovec *iov, int iovcnt);
+void connWriteMap(conn_t *c, void *header, size_t headerlen, char *map, size_t n);
+void connWriteFile(conn_t *c, void *header, size_t headerlen, int fd, off_t n);
+int connPending(conn_t *c);
+int connFlush(conn_t *c);
+void connBlocking(conn_t *c, int blocking);
+void connFree(conn_t *c);
+
+#endif
@@ -494,7 +494,7 @@ int open_clientfd(char *hostname, int port)
  *     Returns -1 and sets errno on Unix error.
  */
 /* $begin open_listenfd */
-int open_listenfd(int port) 
+static int open_listenfd_opt(int port, int reuseport) 
 {
     int listenfd, optval=1;
     struct sockaddr_in serveraddr;
@@ -512,6 +512,14 @@ int open_listenfd(int port)
       return -1;
     }
 
+    /* Lets several sockets listen on the port, and the kernel spread
+       connections over them */
+    if (reuseport && setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, 
+                                (const void *)&optval , sizeof(int)) < 0) {
+      fprintf(stderr, "setsockopt failed\n");
+      return -1;
+    }
+
     /* Listenfd will be an endpoint for all requests to port
        on any IP address for this host */
     bzero((char *) &serveraddr, sizeof(serveraddr));
@@ -530,6 +538,20 @@ int open_listenfd(int port)
     }
     return listenfd;
 }
+
+int open_listenfd(int port) 
+{
+    return open_listenfd_opt(port, 0);
+}
+
+/*
+ * open_reuseport_listenfd - like open_listenfd, but any number of
+ *     sockets can listen on the port this way at once
+ */
+int open_reuseport_listenfd(int port) 
+{
+    return open_listenfd_opt(port, 1);
+}
 /* $end open_listenfd */
 
 /******************************************
@@ -557,4 +579,13 @@ int Open_listenfd(int port)
     return rc;
 }
 
+int Open_reuseport_listenfd(int port) 
+{
+    int rc;
+
+    if ((rc = open_reuseport_listenfd(port)) < 0)
+        unix_error("Open_reuseport_listenfd error");
+    return rc;
+}
+
 
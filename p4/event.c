@@ -0,0 +1,231 @@
+//
+// event.c: Event-driven front end for the server (the -e option).
+//
+// One thread waits in epoll on every connection. It reads requests
+// without blocking, and only passes a connection on to a worker through
+// the buffer once its whole request header is in, so idle and slow
+// clients don't tie up workers. If the client can't take all of the
+// response at once, the worker leaves the rest with the connection and
+// this thread writes it as the socket drains.
+//
+// Connections are registered with EPOLLONESHOT, so each one belongs to
+// one thread at a time: to the event thread once it gets an event, then
+// to a worker if it's passed on, until it is armed again.
+//
+// A kept-alive connection goes back and forth between the two:
+//
+//   READING  the event thread is reading the next request; it's closed
+//            if the request isn't all in by its deadline
+//   WORKING  a worker is answering the requests it has buffered; once
+//            it is done it waits for EPOLLOUT, and the event thread
+//            writes what's left of the responses and then reads again
+//
+// Only the event thread closes connections.
+//
+
+#define _GNU_SOURCE
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include "cs537.h"
+#include "request.h"
+#include "event.h"
+
+#define MAXEVENTS 256
+#define MAXCONNS (1 << 20)  // at most this many open connections
+
+#define READING 0
+#define WORKING 1
+
+void producer(int connfd, unsigned client, char *req, size_t n);  // in server.c
+extern int idle_timeout, max_requests;
+
+static int epfd;
+static conn_t **conns;      // connections by fd
+static int maxconns;
+static int hifd;            // no connection has a higher fd
+
+//
+// Wait for the next events on c
+//
+static void eventArm(conn_t *c, int events)
+{
+   struct epoll_event ev;
+
+   ev.events = events | EPOLLONESHOT;
+   ev.data.fd = c->fd;
+   if (epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev) < 0)
+      unix_error("epoll_ctl error");
+}
+
+static void eventClose(conn_t *c)
+{
+   int fd = c->fd;
+
+   conns[fd] = NULL;
+   connFree(c);
+   free(c);
+   Close(fd);
+}
+
+static void eventAccept(int listenfd)
+{
+   struct epoll_event ev;
+   struct sockaddr_in addr;
+   socklen_t addrlen = sizeof(addr);
+   conn_t *c;
+   int fd;
+
+   while ((fd = accept4(listenfd, (SA *)&addr, &addrlen, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+      if (fd >= maxconns || (c = malloc(sizeof(conn_t))) == NULL) {
+         Close(fd);
+         continue;
+      }
+      connInit(c, fd, 1);
+      c->requests = max_requests;
+      c->client = addr.sin_addr.s_addr;
+      addrlen = sizeof(addr);
+      c->state = READING;
+      c->deadline = time(NULL) + idle_timeout;
+      conns[fd] = c;
+      if (fd > hifd)
+         hifd = fd;
+
+      ev.events = EPOLLIN | EPOLLONESHOT;
+      ev.data.fd = fd;
+      if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+         unix_error("epoll_ctl error");
+   }
+}
+
+//
+// Hand c to a worker to answer the request it has buffered
+//
+static void eventDispatch(conn_t *c)
+{
+   c->state = WORKING;
+   producer(c->fd, c->client, c->rio.rio_bufptr, c->rio.rio_cnt);
+}
+
+//
+// Read what the client sent, and pass the connection on to a worker once
+// the request header is complete
+//
+static void eventRead(conn_t *c)
+{
+   ssize_t n;
+
+   n = connFill(c);
+   if (n == 0 || (n < 0 && errno != EAGAIN)) {
+      eventClose(c);
+      return;
+   }
+
+   // A header that doesn't fit in the buffer goes to a worker too, to be
+   // turned down
+   if (requestReady(c))
+      eventDispatch(c);
+   else
+      eventArm(c, EPOLLIN);
+}
+
+//
+// Write more of the responses, now that the socket has room. Once they're
+// all written, go on to the next request.
+//
+static void eventWrite(conn_t *c)
+{
+   if (!connFlush(c)) {
+      eventArm(c, EPOLLOUT);
+   } else if (!c->keepalive || c->error) {
+      eventClose(c);
+   } else if (requestReady(c)) {
+      eventDispatch(c);
+   } else {
+      c->state = READING;
+      c->deadline = time(NULL) + idle_timeout;
+      eventArm(c, EPOLLIN);
+   }
+}
+
+//
+// Close the connections that have waited too long for a request
+//
+static void eventExpire(void)
+{
+   time_t now = time(NULL);
+   int fd;
+
+   for (fd = 0; fd <= hifd; fd++) {
+      if (conns[fd] != NULL && conns[fd]->state == READING && conns[fd]->deadline <= now)
+         eventClose(conns[fd]);
+   }
+   while (hifd > 0 && conns[hifd] == NULL)
+      hifd--;
+}
+
+//
+// Handle the requests on connection fd, in a worker. Pipelined requests
+// that are already buffered are answered right away, as long as the
+// responses before them went out in full.
+//
+void eventServe(int fd)
+{
+   conn_t *c = conns[fd];
+
+   while (requestHandle(c) && !connPending(c) && requestReady(c))
+      ;
+   eventArm(c, EPOLLOUT);
+}
+
+//
+// Serve the connections to the nlisten sockets listening at listenfds
+//
+void eventLoop(int *listenfds, int nlisten)
+{
+   struct epoll_event ev, events[MAXEVENTS];
+   struct rlimit rl;
+   time_t swept = 0;
+   conn_t *c;
+   int i, n;
+
+   // Allow as many connections as we may have files open
+   getrlimit(RLIMIT_NOFILE, &rl);
+   rl.rlim_cur = rl.rlim_max;
+   setrlimit(RLIMIT_NOFILE, &rl);
+   getrlimit(RLIMIT_NOFILE, &rl);
+   maxconns = rl.rlim_cur < MAXCONNS ? rl.rlim_cur : MAXCONNS;
+   if ((conns = calloc(maxconns, sizeof(conn_t *))) == NULL)
+      app_error("eventLoop error: out of memory");
+
+   if ((epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+      unix_error("epoll_create1 error");
+   // Listening sockets are the only ones without a connection
+   for (i = 0; i < nlisten; i++) {
+      fcntl(listenfds[i], F_SETFL, fcntl(listenfds[i], F_GETFL) | O_NONBLOCK);
+      ev.events = EPOLLIN;
+      ev.data.fd = listenfds[i];
+      if (epoll_ctl(epfd, EPOLL_CTL_ADD, listenfds[i], &ev) < 0)
+         unix_error("epoll_ctl error");
+   }
+
+   while (1) {
+      if ((n = epoll_wait(epfd, events, MAXEVENTS, 1000)) < 0) {
+         if (errno == EINTR)
+            continue;
+         unix_error("epoll_wait error");
+      }
+      for (i = 0; i < n; i++) {
+         c = conns[events[i].data.fd];
+         if (c == NULL)
+            eventAccept(events[i].data.fd);
+         else if (c->state == WORKING)
+            eventWrite(c);
+         else
+            eventRead(c);
+      }
+      if (time(NULL) != swept) {
+         eventExpire();
+         swept = time(NULL);
+      }
+   }
+}
@@ -0,0 +1,7 @@
+#ifndef __EVENT_H__
+#define __EVENT_H__
+
+void eventLoop(int *listenfds, int nlisten);
+void eventServe(int fd);
+
+#endif
@@ -0,0 +1,297 @@
+//
+// http.c: Parsing request headers (see http.h).
+//
+// It's one pass over the bytes with a state machine, so a header that
+// comes in pieces is never looked at twice, and nothing is copied or
+// allocated. It takes what RFC 7230 says a server should take: blank lines
+// before the request line, bare LF line ends, and blanks around values.
+//
+
+#include <string.h>
+#include <strings.h>
+#include "http.h"
+
+enum {
+   S_START,          // before the request line
+   S_METHOD,
+   S_URISTART,
+   S_URI,
+   S_VERSIONSTART,
+   S_VERSION,
+   S_LINEEND,        // blanks after the version
+   S_LINELF,         // the LF after the request line's CR
+   S_HDRSTART,       // at the start of a header line, or of the empty line
+   S_NAME,
+   S_VALUESTART,
+   S_VALUE,
+   S_ENDLF,          // the LF of the empty line
+   S_DONE
+};
+
+#define HTTP_VERSIONMAX 8   // strlen("HTTP/1.1")
+
+// The characters a method or header name can have
+static const char tchar[256] = {
+   ['0' ... '9'] = 1, ['A' ... 'Z'] = 1, ['a' ... 'z'] = 1,
+   ['!'] = 1, ['#'] = 1, ['$'] = 1, ['%'] = 1, ['&'] = 1, ['\''] = 1,
+   ['*'] = 1, ['+'] = 1, ['-'] = 1, ['.'] = 1, ['^'] = 1, ['_'] = 1,
+   ['`'] = 1, ['|'] = 1, ['~'] = 1,
+};
+
+// And the ones a URI can
+static const char uchar[256] = {
+   ['!' ... '~'] = 1, [0x80 ... 0xff] = 1,
+};
+
+void httpInit(http_req_t *r)
+{
+   memset(r, 0, sizeof(*r));
+   r->state = S_START;
+   r->result = HTTP_MORE;
+}
+
+static void httpSet(http_view_t *v, size_t start, size_t end)
+{
+   v->off = start;
+   v->len = end - start;
+}
+
+//
+// Point the views at buf, and remember how far we got
+//
+static int httpEnd(http_req_t *r, char *buf, size_t pos, int result)
+{
+   r->pos = pos;
+   r->result = result;
+   r->method.p = buf + r->method.off;
+   r->uri.p = buf + r->uri.off;
+   r->version.p = buf + r->version.off;
+   r->host.p = buf + r->host.off;
+   r->connection.p = buf + r->connection.off;
+   r->range.p = buf + r->range.off;
+   r->ifmodified.p = buf + r->ifmodified.off;
+   return result;
+}
+
+//
+// Checks the version is HTTP/<digit>.<digit>, and gets the digits
+//
+static int httpVersion(http_req_t *r, char *buf)
+{
+   char *v = buf + r->version.off;
+
+   if (r->version.len != HTTP_VERSIONMAX || strncmp(v, "HTTP/", 5) ||
+       v[5] < '0' || v[5] > '9' || v[6] != '.' || v[7] < '0' || v[7] > '9')
+      return 0;
+   r->major = v[5] - '0';
+   r->minor = v[7] - '0';
+   return 1;
+}
+
+//
+// The view a header's value goes in, or NULL if it's one we don't look at
+//
+static http_view_t *httpField(http_req_t *r, char *name, size_t len)
+{
+   switch (len) {
+   case 4:
+      return strncasecmp(name, "Host", len) ? NULL : &r->host;
+   case 5:
+      return strncasecmp(name, "Range", len) ? NULL : &r->range;
+   case 10:
+      return strncasecmp(name, "Connection", len) ? NULL : &r->connection;
+   case 17:
+      return strncasecmp(name, "If-Modified-Since", len) ? NULL : &r->ifmodified;
+   }
+   return NULL;
+}
+
+//
+// Parse more of the request whose first n bytes are at buf, going on from
+// where the last call stopped. Returns HTTP_DONE once the whole header
+// has been seen, HTTP_MORE if it needs more bytes, or HTTP_BAD or
+// HTTP_TOOBIG if it should be turned down. Once it's returned something
+// other than HTTP_MORE, it keeps returning that.
+//
+int httpParse(http_req_t *r, char *buf, size_t n)
+{
+   unsigned char ch;
+   char *lf;
+   size_t i, end;
+
+   if (r->result != HTTP_MORE)
+      return httpEnd(r, buf, r->pos, r->result);
+
+   for (i = r->pos; i < n; i++) {
+      ch = buf[i];
+      switch (r->state) {
+      case S_START:
+         if (ch == '\r' || ch == '\n')
+            break;
+         if (!tchar[ch])
+            return httpEnd(r, buf, i, HTTP_BAD);
+         r->mark = i;
+         r->state = S_METHOD;
+         break;
+
+      case S_METHOD:
+         if (ch == ' ') {
+            httpSet(&r->method, r->mark, i);
+            r->state = S_URISTART;
+         } else if (!tchar[ch] || i - r->mark >= HTTP_METHODMAX) {
+            return httpEnd(r, buf, i, HTTP_BAD);
+         }
+         break;
+
+      case S_URISTART:
+         if (ch == ' ')
+            break;
+         if (ch < ' ' || ch == 0x7f)
+            return httpEnd(r, buf, i, HTTP_BAD);
+         r->mark = i;
+         r->state = S_URI;
+         break;
+
+      case S_URI:
+         // Most of the bytes are in runs like this one, so they get a
+         // loop of their own
+         while (i < n && uchar[(unsigned char)buf[i]])
+            i++;
+         if (i - r->mark > HTTP_URIMAX)
+            return httpEnd(r, buf, i, HTTP_TOOBIG);
+         if (i == n)
+            return httpEnd(r, buf, n, HTTP_MORE);
+         // No version (HTTP/0.9, which we don't speak) or a stray byte
+         if (buf[i] != ' ')
+            return httpEnd(r, buf, i, HTTP_BAD);
+         httpSet(&r->uri, r->mark, i);
+         r->state = S_VERSIONSTART;
+         break;
+
+      case S_VERSIONSTART:
+         if (ch == ' ')
+            break;
+         if (ch == '\r' || ch == '\n')
+            return httpEnd(r, buf, i, HTTP_BAD);
+         r->mark = i;
+         r->state = S_VERSION;
+         break;
+
+      case S_VERSION:
+         if (ch == ' ' || ch == '\r' || ch == '\n') {
+            httpSet(&r->version, r->mark, i);
+            if (!httpVersion(r, buf))
+               return httpEnd(r, buf, i, HTTP_BAD);
+            r->state = ch == ' ' ? S_LINEEND : ch == '\r' ? S_LINELF : S_HDRSTART;
+         } else if (i - r->mark >= HTTP_VERSIONMAX) {
+            return httpEnd(r, buf, i, HTTP_BAD);
+         }
+         break;
+
+      case S_LINEEND:
+         if (ch == '\r')
+            r->state = S_LINELF;
+         else if (ch == '\n')
+            r->state = S_HDRSTART;
+         else if (ch != ' ')
+            return httpEnd(r, buf, i, HTTP_BAD);
+         break;
+
+      case S_LINELF:
+         if (ch != '\n')
+            return httpEnd(r, buf, i, HTTP_BAD);
+         r->state = S_HDRSTART;
+         break;
+
+      case S_HDRSTART:
+         if (ch == '\r') {
+            r->state = S_ENDLF;
+         } else if (ch == '\n') {
+            r->state = S_DONE;
+            r->len = i + 1;
+            return httpEnd(r, buf, i + 1, HTTP_DONE);
+         } else if (tchar[ch]) {
+            r->mark = i;
+            r->state = S_NAME;
+         } else {
+            // Including a line folded onto the last one, which is obsolete
+            return httpEnd(r, buf, i, HTTP_BAD);
+         }
+         break;
+
+      case S_NAME:
+         while (i < n && tchar[(unsigned char)buf[i]])
+            i++;
+         if (i == n)
+            return httpEnd(r, buf, n, HTTP_MORE);
+         if (buf[i] != ':')
+            return httpEnd(r, buf, i, HTTP_BAD);
+         r->field = httpField(r, buf + r->mark, i - r->mark);
+         r->state = S_VALUESTART;
+         break;
+
+      case S_VALUESTART:
+         if (ch == ' ' || ch == '\t')
+            break;
+         r->mark = i;
+         r->state = S_VALUE;
+         // fall through
+
+      case S_VALUE:
+         // A value is whatever is up to the end of the line. We only look
+         // at a few, and by length, so the bytes in it don't matter.
+         if ((lf = memchr(buf + i, '\n', n - i)) == NULL)
+            return httpEnd(r, buf, n, HTTP_MORE);
+         i = lf - buf;
+         if (r->field != NULL) {
+            end = i;
+            if (end > r->mark && buf[end - 1] == '\r')
+               end--;
+            while (end > r->mark && (buf[end - 1] == ' ' || buf[end - 1] == '\t'))
+               end--;
+            httpSet(r->field, r->mark, end);
+         }
+         r->state = S_HDRSTART;
+         break;
+
+      case S_ENDLF:
+         if (ch != '\n')
+            return httpEnd(r, buf, i, HTTP_BAD);
+         r->state = S_DONE;
+         r->len = i + 1;
+         return httpEnd(r, buf, i + 1, HTTP_DONE);
+      }
+   }
+   return httpEnd(r, buf, n, HTTP_MORE);
+}
+
+//
+// Returns 1 if v is s, ignoring case
+//
+int httpIs(http_view_t *v, char *s)
+{
+   return v->len == strlen(s) && !strncasecmp(v->p, s, v->len);
+}
+
+//
+// Returns 1 if token is one of the comma separated ones in v, ignoring
+// case (as in "Connection: keep-alive, Upgrade")
+//
+int httpHas(http_view_t *v, char *token)
+{
+   size_t len = strlen(token), i = 0, start, end;
+
+   while (i < v->len) {
+      while (i < v->len && (v->p[i] == ' ' || v->p[i] == '\t' || v->p[i] == ','))
+         i++;
+      start = i;
+      while (i < v->len && v->p[i] != ',')
+         i++;
+      end = i;
+      while (end > start && (v->p[end - 1] == ' ' || v->p[end - 1] == '\t'))
+         end--;
+      if (end - start == len && !strncasecmp(v->p + start, token, len))
+         return 1;
+   }
+   return 0;
+}
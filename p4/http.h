@@ -0,0 +1,47 @@
+#ifndef __HTTP_H__
+#define __HTTP_H__
+
+#include <stddef.h>
+
+//
+// An incremental parser for HTTP request headers. It reads the bytes
+// where they are (in a rio_t buffer, say) and copies nothing: each part it
+// finds is a view, a pointer into the bytes and a length.
+//
+// httpParse() can be called again as more bytes arrive, and goes on from
+// where it stopped. The bytes may move between calls (when the buffer is
+// compacted), as long as they start at the same request: the parser keeps
+// offsets, and sets the views from them each time.
+//
+#define HTTP_METHODMAX 16     // longest method we take
+#define HTTP_URIMAX 4096      // longest URI we take
+
+#define HTTP_MORE 0           // the header isn't all there yet
+#define HTTP_DONE 1           // it is; len says how long it was
+#define HTTP_BAD (-1)         // it's malformed
+#define HTTP_TOOBIG (-2)      // the URI is too long
+
+typedef struct {
+   char *p;
+   size_t len;
+   size_t off;                // of p, from the start of the request
+} http_view_t;
+
+typedef struct {
+   int state;
+   int result;                // what httpParse() last returned
+   size_t pos;                // how far it's looked
+   size_t mark;               // where the part it's in started
+   http_view_t *field;        // the view below that header's value goes in
+   http_view_t method, uri, version;
+   int major, minor;
+   http_view_t host, connection, range, ifmodified;
+   size_t len;                // of the whole header, with the empty line
+} http_req_t;
+
+void httpInit(http_req_t *r);
+int httpParse(http_req_t *r, char *buf, size_t n);
+int httpIs(http_view_t *v, char *s);
+int httpHas(http_view_t *v, char *token);
+
+#endif
@@ -0,0 +1,166 @@
+//
+// httpbench.c: Times the request parser in http.c against the way
+// request.c used to read a request: rio_readlineb() a line at a time into
+// a buffer, sscanf() for the request line, and a strcasestr() for the
+// Connection header.
+//
+// To run:
+//  httpbench [-n <iterations>] [-s <bytes per read>]
+//
+// Each of a few typical requests is parsed n times with each way. With
+// -s, the new parser is also given the request that many bytes at a time,
+// as it would be if the request came in pieces.
+//
+
+#define _GNU_SOURCE
+#include "cs537.h"
+#include "http.h"
+
+int iterations = 1000000, step = 0;
+
+char *requests[] = {
+   // What client.c sends
+   "GET /home.html HTTP/1.1\r\n\r\n",
+   // curl
+   "GET /output.cgi?1 HTTP/1.1\r\n"
+   "Host: localhost:8080\r\n"
+   "User-Agent: curl/8.5.0\r\n"
+   "Accept: */*\r\n"
+   "\r\n",
+   // A browser
+   "GET /images/logo.gif HTTP/1.1\r\n"
+   "Host: www.cs.wisc.edu\r\n"
+   "Connection: keep-alive\r\n"
+   "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/120.0.0.0 Safari/537.36\r\n"
+   "Accept: image/avif,image/webp,image/apng,image/svg+xml,image/*,*/*;q=0.8\r\n"
+   "Referer: http://www.cs.wisc.edu/index.html\r\n"
+   "Accept-Encoding: gzip, deflate\r\n"
+   "Accept-Language: en-US,en;q=0.9\r\n"
+   "Cookie: session=8f14e45fceea167a5a36dedd4bea2543; theme=dark; last=1697400000\r\n"
+   "If-Modified-Since: Sun, 15 Oct 2023 20:00:00 GMT\r\n"
+   "Range: bytes=0-1023\r\n"
+   "\r\n",
+};
+
+#define NREQUESTS (sizeof(requests) / sizeof(requests[0]))
+
+//
+// rio_readlineb() on a buffer: a byte at a time, as it copies them
+//
+size_t readline(char *req, size_t *pos, char *buf, size_t maxlen)
+{
+   size_t n = 0;
+   char c;
+
+   while (n < maxlen - 1 && req[*pos] != '\0') {
+      c = req[(*pos)++];
+      buf[n++] = c;
+      if (c == '\n')
+         break;
+   }
+   buf[n] = '\0';
+   return n;
+}
+
+//
+// The old way. Returns whether the connection stays open, so the work
+// isn't optimized away.
+//
+int oldParse(char *req)
+{
+   char buf[MAXLINE], method[MAXLINE], uri[MAXLINE], version[MAXLINE];
+   size_t pos = 0;
+   int keepalive;
+
+   readline(req, &pos, buf, MAXLINE);
+   if (sscanf(buf, "%s %s %s", method, uri, version) != 3)
+      return -1;
+   keepalive = !strcasecmp(version, "HTTP/1.1");
+   while (readline(req, &pos, buf, MAXLINE) > 0 && strcmp(buf, "\r\n")) {
+      if (!strncasecmp(buf, "Connection:", 11)) {
+         if (strcasestr(buf + 11, "close"))
+            keepalive = 0;
+         else if (strcasestr(buf + 11, "keep-alive"))
+            keepalive = 1;
+      }
+   }
+   return keepalive;
+}
+
+int newParse(char *req, size_t len)
+{
+   http_req_t r;
+   size_t n;
+   int rc;
+
+   httpInit(&r);
+   if (step == 0) {
+      rc = httpParse(&r, req, len);
+   } else {
+      for (n = step; (rc = httpParse(&r, req, n < len ? n : len)) == HTTP_MORE && n < len; n += step)
+         ;
+   }
+   if (rc != HTTP_DONE)
+      return -1;
+   if (httpHas(&r.connection, "close"))
+      return 0;
+   return httpHas(&r.connection, "keep-alive") || r.minor >= 1;
+}
+
+double now()
+{
+   struct timeval t;
+
+   gettimeofday(&t, NULL);
+   return t.tv_sec + t.tv_usec / 1e6;
+}
+
+void run(char *name, int which)
+{
+   double start, secs;
+   long sum = 0;
+   size_t len;
+   int i, j;
+
+   for (j = 0; j < NREQUESTS; j++) {
+      len = strlen(requests[j]);
+      start = now();
+      for (i = 0; i < iterations; i++)
+         sum += which ? newParse(requests[j], len) : oldParse(requests[j]);
+      secs = now() - start;
+      if (sum != iterations) {
+         fprintf(stderr, "error: %s got request %d wrong\n", name, j);
+         exit(1);
+      }
+      sum = 0;
+      printf("%-6s request %d (%4zu bytes): %7.1f ns, %7.1f MB/s\n",
+             name, j, len, secs / iterations * 1e9, len * (double)iterations / secs / 1e6);
+   }
+}
+
+int main(int argc, char *argv[])
+{
+   int opt;
+
+   while ((opt = getopt(argc, argv, "n:s:")) != -1) {
+      switch (opt) {
+      case 'n':
+         iterations = atoi(optarg);
+         break;
+      case 's':
+         step = atoi(optarg);
+         break;
+      default:
+         fprintf(stderr, "Usage: %s [-n <iterations>] [-s <bytes per read>]\n", argv[0]);
+         exit(1);
+      }
+   }
+   if (iterations < 1 || step < 0) {
+      fprintf(stderr, "error: bad arguments\n");
+      exit(1);
+   }
+
+   run("old", 0);
+   run("http", 1);
+   return 0;
+}
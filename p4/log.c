@@ -0,0 +1,133 @@
+//
+// log.c: The access log, written in batches by a thread of its own.
+//
+// Workers add their lines to a buffer in memory, and the log thread
+// writes what's there with one write() once a second, or as soon as the
+// buffer is half full. While it writes, the workers go on with the other
+// of two buffers. So a request costs a copy under a lock, and never waits
+// for the disk (or the terminal). If the log thread falls behind, lines
+// that don't fit are dropped, and it says how many.
+//
+
+#include <stdarg.h>
+#include <time.h>
+#include "cs537.h"
+#include "log.h"
+
+static pthread_mutex_t loglock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t loghalf = PTHREAD_COND_INITIALIZER;  // half full
+static char logbufs[2][LOG_SIZE];
+static char *logbuf = logbufs[0];   // the one the workers add to
+static size_t loglen;
+static unsigned long logdropped;
+static int logfd = -1;
+
+//
+// Write all n bytes at buf, giving up on an error
+//
+static void logWrite(char *buf, size_t n)
+{
+   ssize_t rc;
+
+   while (n > 0) {
+      if ((rc = write(logfd, buf, n)) < 0) {
+         if (errno == EINTR)
+            continue;
+         return;
+      }
+      buf += rc;
+      n -= rc;
+   }
+}
+
+static void *logThread(void *arg)
+{
+   struct timespec deadline;
+   char *out, note[64];
+   unsigned long dropped;
+   size_t n;
+
+   pthread_mutex_lock(&loglock);
+   while (1) {
+      clock_gettime(CLOCK_REALTIME, &deadline);
+      deadline.tv_sec += LOG_INTERVAL;
+      while (loglen < LOG_SIZE / 2 &&
+             pthread_cond_timedwait(&loghalf, &loglock, &deadline) != ETIMEDOUT)
+         ;
+      if (loglen == 0 && logdropped == 0)
+         continue;
+
+      // Take the full buffer, and give the workers the other one
+      out = logbuf;
+      n = loglen;
+      dropped = logdropped;
+      logbuf = logbuf == logbufs[0] ? logbufs[1] : logbufs[0];
+      loglen = 0;
+      logdropped = 0;
+      pthread_mutex_unlock(&loglock);
+
+      logWrite(out, n);
+      if (dropped > 0) {
+         snprintf(note, sizeof(note), "(%lu log lines dropped)\n", dropped);
+         logWrite(note, strlen(note));
+      }
+      pthread_mutex_lock(&loglock);
+   }
+   return NULL;
+}
+
+//
+// Start writing the log to fd
+//
+void logInit(int fd)
+{
+   pthread_t thread;
+
+   logfd = fd;
+   pthread_create(&thread, NULL, logThread, NULL);
+   pthread_detach(thread);
+}
+
+//
+// Add a line to the log (fmt should end it with a newline)
+//
+void logPrintf(char *fmt, ...)
+{
+   va_list ap;
+   int n;
+
+   if (logfd < 0)
+      return;
+   pthread_mutex_lock(&loglock);
+   va_start(ap, fmt);
+   n = vsnprintf(logbuf + loglen, LOG_SIZE - loglen, fmt, ap);
+   va_end(ap);
+   // What doesn't fit is left past loglen, for the next line to write over
+   if (n < 0 || n >= LOG_SIZE - loglen) {
+      logdropped++;
+   } else {
+      loglen += n;
+      if (loglen >= LOG_SIZE / 2)
+         pthread_cond_signal(&loghalf);
+   }
+   pthread_mutex_unlock(&loglock);
+}
+
+//
+// The time now, as the log shows it. Each thread formats it again only
+// when the second changes.
+//
+char *logTime(void)
+{
+   static __thread time_t last = -1;
+   static __thread char stamp[32];
+   time_t now = time(NULL);
+   struct tm tm;
+
+   if (now != last) {
+      localtime_r(&now, &tm);
+      strftime(stamp, sizeof(stamp), "%d/%b/%Y:%H:%M:%S %z", &tm);
+      last = now;
+   }
+   return stamp;
+}
@@ -0,0 +1,11 @@
+#ifndef __LOG_H__
+#define __LOG_H__
+
+#define LOG_SIZE (1 << 16)   // bytes of lines held while the last batch is written
+#define LOG_INTERVAL 1       // seconds a line may wait to be written
+
+void logInit(int fd);
+void logPrintf(char *fmt, ...) __attribute__((format(printf, 1, 2)));
+char *logTime(void);
+
+#endif
@@ -1,4 +1,5 @@
 #include "cs537.h"
+#include "cgilib.h"
 #include <sys/time.h>
 #include <assert.h>
 #include <unistd.h>
@@ -37,24 +38,29 @@ double Time_GetSeconds() {
 int main(int argc, char *argv[])
 {
   char content[MAXBUF];
+  int n;
 
-  getargs();
-
-  double t1 = Time_GetSeconds();
-  while ((Time_GetSeconds() - t1) < spinfor)
-      sleep(1);
-  double t2 = Time_GetSeconds();
-
-  /* Make the response body */
-  sprintf(content, "<p>Welcome to the CGI program</p>\r\n");
-  sprintf(content, "%s<p>My only purpose is to waste time on the server!</p>\r\n", content);
-  sprintf(content, "%s<p>I spun for %.2f seconds</p>\r\n", content, t2 - t1);
-  
-  /* Generate the HTTP response */
-  printf("Content-length: %lu\r\n", strlen(content));
-  printf("Content-type: text/html\r\n\r\n");
-  printf("%s", content);
-  fflush(stdout);
+  // One request, or one after another if the server keeps us running
+  while (cgiAccept()) {
+    spinfor = 5.0;
+    getargs();
+
+    double t1 = Time_GetSeconds();
+    while ((Time_GetSeconds() - t1) < spinfor)
+        sleep(1);
+    double t2 = Time_GetSeconds();
+
+    /* Make the response body */
+    n = snprintf(content, sizeof(content), "<p>Welcome to the CGI program</p>\r\n");
+    n += snprintf(content + n, sizeof(content) - n, "<p>My only purpose is to waste time on the server!</p>\r\n");
+    n += snprintf(content + n, sizeof(content) - n, "<p>I spun for %.2f seconds</p>\r\n", t2 - t1);
+
+    /* Generate the HTTP response */
+    printf("Content-length: %lu\r\n", strlen(content));
+    printf("Content-type: text/html\r\n\r\n");
+    printf("%s", content);
+    fflush(stdout);
+  }
 
   exit(0);
 }
@@ -2,81 +2,120 @@
 // request.c: Does the bulk of the work for the web server.
 // 
 
+#define _GNU_SOURCE
+#include <stdarg.h>
 #include "cs537.h"
 #include "request.h"
+#include "cache.h"
+#include "cgi.h"
+#include "log.h"
 
-// requestError(      fd,    filename,        "404",    "Not found", "CS537 Server could not find this file");
-void requestError(int fd, char *cause, char *errnum, char *shortmsg, char *longmsg) 
-{
-   char buf[MAXLINE], body[MAXBUF];
+//
+// A response header (or a short body), put together in one buffer so that
+// it goes out with what follows in one writev()
+//
+typedef struct {
+   char buf[MAXBUF];
+   size_t len;
+} resp_t;
 
-   // Create the body of the error message
-   sprintf(body, "<html><title>CS537 Error</title>");
-   sprintf(body, "%s<body bgcolor=""fffff"">\r\n", body);
-   sprintf(body, "%s%s: %s\r\n", body, errnum, shortmsg);
-   sprintf(body, "%s<p>%s: %s\r\n", body, longmsg, cause);
-   sprintf(body, "%s<hr>CS537 Web Server\r\n", body);
+void respInit(resp_t *r)
+{
+   r->buf[0] = '\0';
+   r->len = 0;
+}
 
-   // Write out the header information for this response
-   sprintf(buf, "HTTP/1.0 %s %s\r\n", errnum, shortmsg);
-   Rio_writen(fd, buf, strlen(buf));
-   printf("%s", buf);
+// Appends to r, cutting off what doesn't fit
+void respAdd(resp_t *r, char *fmt, ...)
+{
+   va_list ap;
+   int n;
+
+   va_start(ap, fmt);
+   n = vsnprintf(r->buf + r->len, sizeof(r->buf) - r->len, fmt, ap);
+   va_end(ap);
+   if (n > 0)
+      r->len += n < sizeof(r->buf) - r->len ? n : sizeof(r->buf) - r->len - 1;
+}
 
-   sprintf(buf, "Content-Type: text/html\r\n");
-   Rio_writen(fd, buf, strlen(buf));
-   printf("%s", buf);
+// Writes header and then the n bytes at body, with one writev()
+void respSend(conn_t *c, resp_t *header, void *body, size_t n)
+{
+   struct iovec iov[2];
 
-   sprintf(buf, "Content-Length: %lu\r\n\r\n", strlen(body));
-   Rio_writen(fd, buf, strlen(buf));
-   printf("%s", buf);
+   iov[0].iov_base = header->buf;
+   iov[0].iov_len = header->len;
+   iov[1].iov_base = body;
+   iov[1].iov_len = n;
+   connWritev(c, iov, 2);
+}
 
-   // Write out the content
-   Rio_writen(fd, body, strlen(body));
-   printf("%s", body);
+// requestError(       c,    filename,        "404",    "Not found", "CS537 Server could not find this file");
+void requestError(conn_t *c, char *cause, char *errnum, char *shortmsg, char *longmsg) 
+{
+   resp_t header, body;
 
+   // Create the body of the error message
+   respInit(&body);
+   respAdd(&body, "<html><title>CS537 Error</title>");
+   respAdd(&body, "<body bgcolor=""fffff"">\r\n");
+   respAdd(&body, "%s: %s\r\n", errnum, shortmsg);
+   respAdd(&body, "<p>%s: %s\r\n", longmsg, cause);
+   respAdd(&body, "<hr>CS537 Web Server\r\n");
+
+   // Then the header information for this response, and write out both
+   respInit(&header);
+   respAdd(&header, "HTTP/1.1 %s %s\r\n", errnum, shortmsg);
+   respAdd(&header, "Content-Type: text/html\r\n");
+   respAdd(&header, "Connection: %s\r\n", c->keepalive ? "keep-alive" : "close");
+   respAdd(&header, "Content-Length: %zu\r\n\r\n", body.len);
+   respSend(c, &header, body.buf, body.len);
+
+   c->status = atoi(errnum);
+   c->length = body.len;
 }
 
 
 //
-// Reads and discards everything up to an empty text line
+// Returns 1 if the bytes buffered for c hold a whole request header, so
+// that reading it won't block, or if they never will: it's malformed, or
+// too big for the buffer
 //
-void requestReadhdrs(rio_t *rp)
+int requestReady(conn_t *c)
 {
-   char buf[MAXLINE];
-
-   Rio_readlineb(rp, buf, MAXLINE);
-   while (strcmp(buf, "\r\n")) {
-      Rio_readlineb(rp, buf, MAXLINE);
-   }
-   return;
+   return httpParse(&c->req, c->rio.rio_bufptr, c->rio.rio_cnt) != HTTP_MORE || c->rio.rio_cnt == RIO_BUFSIZE;
 }
 
 //
 // Return 1 if static, 0 if dynamic content
 // Calculates filename (and cgiargs, for dynamic) from uri
 //
-int requestParseURI(char *uri, char *filename, char *cgiargs) 
+int requestParseURI(http_view_t *uri, char *filename, char *cgiargs)
 {
-   char *ptr;
+   char *query;
+   size_t len;
 
-   if (!strstr(uri, "cgi")) {
+   // The path is what's before any '?'
+   query = memchr(uri->p, '?', uri->len);
+   len = query ? query - uri->p : uri->len;
+   filename[0] = '.';
+   memcpy(filename + 1, uri->p, len);
+   filename[len + 1] = '\0';
+
+   if (!memmem(uri->p, len, "cgi", 3)) {
       // static
-      strcpy(cgiargs, "");
-      sprintf(filename, ".%s", uri);
-      if (uri[strlen(uri)-1] == '/') {
-         strcat(filename, "home.html");
-      }
+      cgiargs[0] = '\0';
+      if (len == 0 || uri->p[len - 1] == '/')
+         strcpy(filename + len + 1, "home.html");
       return 1;
    } else {
       // dynamic
-      ptr = index(uri, '?');
-      if (ptr) {
-         strcpy(cgiargs, ptr+1);
-         *ptr = '\0';
-      } else {
-         strcpy(cgiargs, "");
+      len = 0;
+      if (query) {
+         len = uri->len - (query + 1 - uri->p);
+         memcpy(cgiargs, query + 1, len);
       }
-      sprintf(filename, ".%s", uri);
+      cgiargs[len] = '\0';
       return 0;
    }
 }
@@ -96,97 +135,260 @@ void requestGetFiletype(char *filename, char *filetype)
       strcpy(filetype, "text/plain");
 }
 
-void requestServeDynamic(int fd, char *filename, char *cgiargs)
+void requestServeDynamic(conn_t *c, char *filename, char *cgiargs)
 {
-   char buf[MAXLINE], *emptylist[] = {NULL};
+   resp_t header;
 
    // The server does only a little bit of the header.  
    // The CGI script has to finish writing out the header.
-   sprintf(buf, "HTTP/1.0 200 OK\r\n");
-   sprintf(buf, "%sServer: CS537 Web Server\r\n", buf);
+   // Since we can't tell where its output ends, the connection closes
+   // after it.
+   c->keepalive = 0;
+   respInit(&header);
+   respAdd(&header, "HTTP/1.1 200 OK\r\n");
+   respAdd(&header, "Server: CS537 Web Server\r\n");
+   respAdd(&header, "Connection: close\r\n");
+
+   // cgi.c writes the header once the program is running
+   c->status = 200;
+   if (cgiRun(c, filename, cgiargs, header.buf) == CGI_BUSY)
+      requestError(c, filename, "503", "Service Unavailable", "CS537 Server has too many requests for this CGI program");
+}
 
-   Rio_writen(fd, buf, strlen(buf));
 
-   if (Fork() == 0) {
-      /* Child process */
-      Setenv("QUERY_STRING", cgiargs, 1);
-      /* When the CGI process writes to stdout, it will instead go to the socket */
-      Dup2(fd, STDOUT_FILENO);
-      Execve(filename, emptylist, environ);
-   }
-   Wait(NULL);
+//
+// Puts together the header of a response with a static file
+//
+void requestStaticHeader(resp_t *r, int keepalive, off_t filesize, char *filetype)
+{
+   respInit(r);
+   respAdd(r, "HTTP/1.1 200 OK\r\n");
+   respAdd(r, "Server: CS537 Web Server\r\n");
+   respAdd(r, "Connection: %s\r\n", keepalive ? "keep-alive" : "close");
+   respAdd(r, "Content-Length: %lld\r\n", (long long)filesize);
+   respAdd(r, "Content-Type: %s\r\n\r\n", filetype);
 }
 
+//
+// Serves a file from the cache: a small one with a single writev() of
+// its header and contents, a big one with sendfile()
+//
+void requestServeCached(conn_t *c, cache_entry_t *e)
+{
+   struct iovec iov[2];
+   int fd;
+
+   c->status = 200;
+   c->length = e->size;
+   if (e->fd < 0) {
+      iov[0].iov_base = e->header[c->keepalive];
+      iov[0].iov_len = e->headerlen[c->keepalive];
+      iov[1].iov_base = e->body;
+      iov[1].iov_len = e->size;
+      connWritev(c, iov, 2);
+   } else if ((fd = fcntl(e->fd, F_DUPFD_CLOEXEC, 0)) < 0) {
+      requestError(c, e->path, "500", "Internal Server Error", "CS537 Server could not open this file");
+   } else {
+      // sendfile() is given the offset, so it's fine to share the file
+      connWriteFile(c, e->header[c->keepalive], e->headerlen[c->keepalive], fd, e->size);
+   }
+}
 
-void requestServeStatic(int fd, char *filename, int filesize) 
+void requestServeStatic(conn_t *c, char *filename, int filesize) 
 {
    int srcfd;
-   char *srcp, filetype[MAXLINE], buf[MAXBUF];
+   struct stat sbuf;
+   cache_entry_t *e;
+   char *srcp, filetype[MAXLINE], *header[2];
+   resp_t buf, other;
 
    requestGetFiletype(filename, filetype);
 
    srcfd = Open(filename, O_RDONLY, 0);
 
-   // Rather than call read() to read the file into memory, 
-   // which would require that we allocate a buffer, we memory-map the file
-   srcp = Mmap(0, filesize, PROT_READ, MAP_PRIVATE, srcfd, 0);
-   Close(srcfd);
+   if (fstat(srcfd, &sbuf) == 0 && S_ISREG(sbuf.st_mode)) {
+      // Cache it with the header for either kind of connection, so that
+      // next time it's served without all this
+      requestStaticHeader(&buf, c->keepalive, sbuf.st_size, filetype);
+      requestStaticHeader(&other, !c->keepalive, sbuf.st_size, filetype);
+      header[c->keepalive] = buf.buf;
+      header[!c->keepalive] = other.buf;
+      if ((e = cacheAdd(filename, srcfd, &sbuf, header)) != NULL) {
+         requestServeCached(c, e);
+         cachePut(e);
+         Close(srcfd);
+         return;
+      }
+
+      // A regular file goes straight from the page cache to the socket with
+      // sendfile(), right behind its header (connWriteFile closes it once
+      // it's all written)
+      c->status = 200;
+      c->length = sbuf.st_size;
+      connWriteFile(c, buf.buf, buf.len, srcfd, sbuf.st_size);
+      return;
+   }
 
    // put together response
-   sprintf(buf, "HTTP/1.0 200 OK\r\n");
-   sprintf(buf, "%sServer: CS537 Web Server\r\n", buf);
-   sprintf(buf, "%sContent-Length: %d\r\n", buf, filesize);
-   sprintf(buf, "%sContent-Type: %s\r\n\r\n", buf, filetype);
+   requestStaticHeader(&buf, c->keepalive, filesize, filetype);
+   c->status = 200;
+   c->length = filesize;
+
+   // Anything else we memory-map, rather than call read() to read the file
+   // into memory, which would require that we allocate a buffer
+   if (filesize > 0) {
+      srcp = Mmap(0, filesize, PROT_READ, MAP_PRIVATE, srcfd, 0);
+      //  Writes out to the client socket the header and the memory-mapped
+      //  file (which connWriteMap unmaps once it's all written)
+      connWriteMap(c, buf.buf, buf.len, srcp, filesize);
+   } else {
+      connWrite(c, buf.buf, buf.len);
+   }
+   Close(srcfd);
+}
 
-   Rio_writen(fd, buf, strlen(buf));
+//
+// Guesses how big the response to a request will be, from the n bytes of
+// it at buf, for sff scheduling. Returns 0 if it can't tell: the request
+// line isn't all there, or it isn't for a static file we can find.
+//
+off_t requestSize(char *buf, size_t n)
+{
+   char filename[MAXLINE], cgiargs[MAXLINE];
+   struct stat sbuf;
+   cache_entry_t *e;
+   http_req_t r;
+   off_t size;
 
-   //  Writes out to the client socket the memory-mapped file 
-   Rio_writen(fd, srcp, filesize);
-   Munmap(srcp, filesize);
+   // The version is set once the request line has been parsed
+   httpInit(&r);
+   if (httpParse(&r, buf, n) < 0 || r.version.len == 0 || !httpIs(&r.method, "GET"))
+      return 0;
+   if (!requestParseURI(&r.uri, filename, cgiargs))
+      return 0;
 
+   if ((e = cacheGet(filename)) != NULL) {
+      size = e->size;
+      cachePut(e);
+      return size;
+   }
+   if (stat(filename, &sbuf) < 0 || !S_ISREG(sbuf.st_mode))
+      return 0;
+   return sbuf.st_size;
 }
 
-// handle a request
-void requestHandle(int fd)
+//
+// Adds the request to the access log, in the Common Log Format. rc is
+// what parsing it returned; unless it's HTTP_DONE, r isn't used.
+//
+void requestLog(conn_t *c, http_req_t *r, int rc)
 {
+   char addr[INET_ADDRSTRLEN], length[32];
+
+   inet_ntop(AF_INET, &c->client, addr, sizeof(addr));
+   if (c->length < 0)
+      strcpy(length, "-");
+   else
+      snprintf(length, sizeof(length), "%lld", (long long)c->length);
+
+   if (rc == HTTP_DONE)
+      logPrintf("%s - - [%s] \"%.*s %.*s %.*s\" %d %s\n", addr, logTime(),
+                (int)r->method.len, r->method.p, (int)r->uri.len, r->uri.p,
+                (int)r->version.len, r->version.p, c->status, length);
+   else
+      logPrintf("%s - - [%s] \"-\" %d %s\n", addr, logTime(), c->status, length);
+}
 
+//
+// Answers the request r, which parsing returned rc for
+//
+void requestServe(conn_t *c, http_req_t *r, int rc)
+{
    int is_static;
    struct stat sbuf;
-   char buf[MAXLINE], method[MAXLINE], uri[MAXLINE], version[MAXLINE];
-   char filename[MAXLINE], cgiargs[MAXLINE];
-   rio_t rio;
-
-   Rio_readinitb(&rio, fd);
-   Rio_readlineb(&rio, buf, MAXLINE);
-   sscanf(buf, "%s %s %s", method, uri, version);
+   cache_entry_t *e;
+   char method[HTTP_METHODMAX + 1], filename[MAXLINE], cgiargs[MAXLINE];
 
-   printf("%s %s %s\n", method, uri, version);
-
-   if (strcasecmp(method, "GET")) {
-      requestError(fd, method, "501", "Not Implemented", "CS537 Server does not implement this method");
+   if (rc == HTTP_MORE) {
+      requestError(c, "header", "431", "Request Header Fields Too Large", "CS537 Server could not take this request");
+      return;
+   }
+   if (rc == HTTP_TOOBIG) {
+      requestError(c, "URI", "414", "URI Too Long", "CS537 Server could not take this request");
+      return;
+   }
+   if (rc == HTTP_BAD) {
+      requestError(c, "request", "400", "Bad Request", "CS537 Server could not understand this request");
       return;
    }
-   requestReadhdrs(&rio);
 
-   is_static = requestParseURI(uri, filename, cgiargs);
-   if (stat(filename, &sbuf) < 0) {
-      requestError(fd, filename, "404", "Not found", "CS537 Server could not find this file");
+   // Whatever follows the header of another method is left unread, so
+   // the connection can't be used after it
+   if (!httpIs(&r->method, "GET")) {
+      memcpy(method, r->method.p, r->method.len);
+      method[r->method.len] = '\0';
+      requestError(c, method, "501", "Not Implemented", "CS537 Server does not implement this method");
       return;
    }
 
-   if (is_static) {
+   // HTTP/1.1 keeps the connection open unless it says otherwise, and
+   // HTTP/1.0 only if it asks to
+   if (httpHas(&r->connection, "close"))
+      c->keepalive = 0;
+   else if (httpHas(&r->connection, "keep-alive"))
+      c->keepalive = 1;
+   else
+      c->keepalive = r->major == 1 && r->minor >= 1;
+   c->keepalive = c->keepalive && --c->requests > 0;
+
+   is_static = requestParseURI(&r->uri, filename, cgiargs);
+   if (is_static && (e = cacheGet(filename)) != NULL) {
+      requestServeCached(c, e);
+      cachePut(e);
+   } else if (stat(filename, &sbuf) < 0) {
+      requestError(c, filename, "404", "Not found", "CS537 Server could not find this file");
+   } else if (is_static) {
       if (!(S_ISREG(sbuf.st_mode)) || !(S_IRUSR & sbuf.st_mode)) {
-         requestError(fd, filename, "403", "Forbidden", "CS537 Server could not read this file");
-         return;
+         requestError(c, filename, "403", "Forbidden", "CS537 Server could not read this file");
+      } else {
+         requestServeStatic(c, filename, sbuf.st_size);
       }
-      requestServeStatic(fd, filename, sbuf.st_size);
    } else {
       if (!(S_ISREG(sbuf.st_mode)) || !(S_IXUSR & sbuf.st_mode)) {
-         requestError(fd, filename, "403", "Forbidden", "CS537 Server could not run this CGI program");
-         return;
+         requestError(c, filename, "403", "Forbidden", "CS537 Server could not run this CGI program");
+      } else {
+         requestServeDynamic(c, filename, cgiargs);
       }
-      requestServeDynamic(fd, filename, cgiargs);
    }
 }
 
+// handle a request
+// returns 1 if the connection stays open for the next one
+int requestHandle(conn_t *c)
+{
+   http_req_t r;
+   int rc;
+
+   // Read until the header is all there (in event.c it already is). The
+   // views in it stay good until the next read.
+   c->keepalive = 0;
+   while ((rc = httpParse(&c->req, c->rio.rio_bufptr, c->rio.rio_cnt)) == HTTP_MORE) {
+      if (c->rio.rio_cnt == RIO_BUFSIZE)
+         break;
+      // Nothing more from the client (or it was idle for too long)
+      if (connFill(c) <= 0)
+         return 0;
+   }
+   r = c->req;
+   httpInit(&c->req);
+   if (rc == HTTP_DONE) {
+      c->rio.rio_bufptr += r.len;
+      c->rio.rio_cnt -= r.len;
+   }
 
+   c->status = 0;
+   c->length = -1;
+   requestServe(c, &r, rc);
+   requestLog(c, &r, rc);
+   return c->keepalive && !c->error;
+}
@@ -1,5 +1,9 @@
 #ifndef __REQUEST_H__
 
-void requestHandle(int fd);
+#include "conn.h"
+
+int requestReady(conn_t *c);
+int requestHandle(conn_t *c);
+off_t requestSize(char *buf, size_t n);
 
 #endif
@@ -0,0 +1,180 @@
+//
+// ring.c: Lock-free bounded queue of ints, for handing connections to
+// the worker threads.
+//
+// Pushing and popping only take a compare and swap on the tail or head.
+// A thread only makes a system call when it has to wait. It first yields
+// the CPU a few times, since the other side is usually about to catch up,
+// and then sleeps on a futex while the ring is empty (to pop) or full (to
+// push). The other side only wakes it if it has said it's waiting.
+//
+
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include "cs537.h"
+#include "ring.h"
+
+void ringInit(ring_t *r, int size)
+{
+   unsigned long i;
+
+   memset(r, 0, sizeof(ring_t));
+   if ((r->slots = malloc(size * sizeof(ring_slot_t))) == NULL)
+      app_error("ringInit error: out of memory");
+   r->size = size;
+   // Slot i is free to push to at position i. Sequence numbers go up by 2
+   // per position, so that "full at position p" (2p+1) can't be mistaken
+   // for "free at position p+1" (2p+2) even when there's only one slot.
+   for (i = 0; i < r->size; i++)
+      r->slots[i].seq = 2 * i;
+}
+
+//
+// Push value, unless the ring is full. Returns whether it did.
+//
+int ringTryPush(ring_t *r, int value)
+{
+   unsigned long pos = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+   ring_slot_t *slot;
+   long diff;
+
+   while (1) {
+      slot = &r->slots[pos % r->size];
+      diff = (long)(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - 2 * pos);
+      if (diff == 0) {
+         // The slot is free; claim the position
+         if (__atomic_compare_exchange_n(&r->tail, &pos, pos + 1, 1,
+                                         __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            break;
+      } else if (diff < 0) {
+         // It still holds what was pushed a lap ago
+         return 0;
+      } else {
+         // Someone else took the position
+         pos = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+      }
+   }
+   slot->value = value;
+   __atomic_store_n(&slot->seq, 2 * pos + 1, __ATOMIC_RELEASE);
+   return 1;
+}
+
+//
+// Pop into value, unless the ring is empty. Returns whether it did.
+//
+int ringTryPop(ring_t *r, int *value)
+{
+   unsigned long pos = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+   ring_slot_t *slot;
+   long diff;
+
+   while (1) {
+      slot = &r->slots[pos % r->size];
+      diff = (long)(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - (2 * pos + 1));
+      if (diff == 0) {
+         if (__atomic_compare_exchange_n(&r->head, &pos, pos + 1, 1,
+                                         __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            break;
+      } else if (diff < 0) {
+         // Nothing has been pushed there yet
+         return 0;
+      } else {
+         pos = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+      }
+   }
+   *value = slot->value;
+   // Free the slot for the push a lap from now
+   __atomic_store_n(&slot->seq, 2 * (pos + r->size), __ATOMIC_RELEASE);
+   return 1;
+}
+
+//
+// Wake one thread sleeping on wake, if any say they are
+//
+static void ringWake(unsigned int *wake, int *waiters)
+{
+   __atomic_thread_fence(__ATOMIC_SEQ_CST);
+   if (__atomic_load_n(waiters, __ATOMIC_RELAXED) > 0) {
+      __atomic_add_fetch(wake, 1, __ATOMIC_SEQ_CST);
+      syscall(SYS_futex, wake, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+   }
+}
+
+//
+// Get ready to sleep on wake: returns its value, which anyone who wakes
+// us changes, so a wakeup after this isn't missed
+//
+static unsigned int ringWaiting(unsigned int *wake, int *waiters)
+{
+   unsigned int key = __atomic_load_n(wake, __ATOMIC_SEQ_CST);
+
+   __atomic_add_fetch(waiters, 1, __ATOMIC_SEQ_CST);
+   __atomic_thread_fence(__ATOMIC_SEQ_CST);
+   return key;
+}
+
+static void ringSleep(unsigned int *wake, int *waiters, unsigned int key)
+{
+   syscall(SYS_futex, wake, FUTEX_WAIT_PRIVATE, key, NULL, NULL, 0);
+   __atomic_sub_fetch(waiters, 1, __ATOMIC_SEQ_CST);
+}
+
+//
+// Push value, waiting for room if the ring is full
+//
+void ringPush(ring_t *r, int value)
+{
+   unsigned int key;
+   int spins = 0;
+
+   while (!ringTryPush(r, value)) {
+      if (spins++ < RING_SPINS) {
+         sched_yield();
+         continue;
+      }
+      key = ringWaiting(&r->pushwake, &r->pushwaiters);
+      // Try again, in case it was popped from before we said we're waiting
+      if (ringTryPush(r, value)) {
+         __atomic_sub_fetch(&r->pushwaiters, 1, __ATOMIC_SEQ_CST);
+         break;
+      }
+      ringSleep(&r->pushwake, &r->pushwaiters, key);
+   }
+   ringWake(&r->popwake, &r->popwaiters);
+}
+
+//
+// Pop a value, waiting for one if the ring is empty
+//
+int ringPop(ring_t *r)
+{
+   unsigned int key;
+   int value, spins = 0;
+
+   while (!ringTryPop(r, &value)) {
+      if (spins++ < RING_SPINS) {
+         sched_yield();
+         continue;
+      }
+      key = ringWaiting(&r->popwake, &r->popwaiters);
+      if (ringTryPop(r, &value)) {
+         __atomic_sub_fetch(&r->popwaiters, 1, __ATOMIC_SEQ_CST);
+         break;
+      }
+      ringSleep(&r->popwake, &r->popwaiters, key);
+   }
+   ringWake(&r->pushwake, &r->pushwaiters);
+   return value;
+}
+
+//
+// How many values are in the ring. Other threads may push and pop at the
+// same time, so it's only a hint.
+//
+int ringCount(ring_t *r)
+{
+   unsigned long head = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+   unsigned long tail = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+
+   return tail > head ? tail - head : 0;
+}
@@ -0,0 +1,37 @@
+#ifndef __RING_H__
+#define __RING_H__
+
+#define RING_LINE 64   // cache line size, to keep the hot fields apart
+#define RING_SPINS 4   // times to yield before sleeping
+
+//
+// A bounded queue of ints that any number of threads can push to and pop
+// from without a lock. Each slot has a sequence number that says whether
+// it's ready to be pushed to or popped from at a given position (Vyukov's
+// bounded MPMC queue); a thread claims a position with one compare and swap.
+//
+typedef struct {
+   unsigned long seq;
+   int value;
+} ring_slot_t;
+
+typedef struct {
+   ring_slot_t *slots;
+   unsigned long size;
+   unsigned long head __attribute__((aligned(RING_LINE)));  // next to pop
+   unsigned long tail __attribute__((aligned(RING_LINE)));  // next to push
+   // Threads waiting for it to be non-empty or non-full sleep on these
+   unsigned int popwake __attribute__((aligned(RING_LINE)));
+   int popwaiters;
+   unsigned int pushwake __attribute__((aligned(RING_LINE)));
+   int pushwaiters;
+} ring_t;
+
+void ringInit(ring_t *r, int size);
+int ringTryPush(ring_t *r, int value);
+int ringTryPop(ring_t *r, int *value);
+void ringPush(ring_t *r, int value);
+int ringPop(ring_t *r);
+int ringCount(ring_t *r);
+
+#endif
@@ -0,0 +1,169 @@
+//
+// ringbench.c: Compares the two ways server.c can hand connections to its
+// workers: the bounded buffer with a mutex and two condition variables,
+// and the lock-free ring in ring.c.
+//
+// To run:
+//  ringbench [-p <producers>] [-c <consumers>] [-n <items>] [-b <buffers>]
+//
+// The producers push n ints in all, through a buffer of the given size,
+// and the consumers pop them. Each queue reports how long that took.
+//
+
+#include "cs537.h"
+#include "ring.h"
+
+int producers = 1, consumers = 8, items = 4000000, buffers = 16;
+
+//
+// The bounded buffer server.c used to have
+//
+typedef struct {
+   pthread_mutex_t mutex;
+   pthread_cond_t full, empty;
+   int *buffer;
+   int max, fill, use, count;
+} locked_t;
+
+void lockedInit(locked_t *q, int size)
+{
+   pthread_mutex_init(&q->mutex, NULL);
+   pthread_cond_init(&q->full, NULL);
+   pthread_cond_init(&q->empty, NULL);
+   q->buffer = malloc(size * sizeof(int));
+   q->max = size;
+   q->fill = q->use = q->count = 0;
+}
+
+void lockedPush(locked_t *q, int value)
+{
+   pthread_mutex_lock(&q->mutex);
+   while (q->count == q->max)
+      pthread_cond_wait(&q->empty, &q->mutex);
+   q->buffer[q->fill] = value;
+   q->fill = (q->fill + 1) % q->max;
+   q->count++;
+   pthread_cond_signal(&q->full);
+   pthread_mutex_unlock(&q->mutex);
+}
+
+int lockedPop(locked_t *q)
+{
+   int value;
+
+   pthread_mutex_lock(&q->mutex);
+   while (q->count == 0)
+      pthread_cond_wait(&q->full, &q->mutex);
+   value = q->buffer[q->use];
+   q->use = (q->use + 1) % q->max;
+   q->count--;
+   pthread_cond_signal(&q->empty);
+   pthread_mutex_unlock(&q->mutex);
+   return value;
+}
+
+locked_t locked;
+ring_t ring;
+int useRing;
+
+void push(int value)
+{
+   if (useRing)
+      ringPush(&ring, value);
+   else
+      lockedPush(&locked, value);
+}
+
+int pop()
+{
+   return useRing ? ringPop(&ring) : lockedPop(&locked);
+}
+
+void *producer(void *arg)
+{
+   long n = (long)arg, i;
+
+   for (i = 0; i < n; i++)
+      push(i);
+   return NULL;
+}
+
+// Pops until it gets a -1, and returns how many it got before that
+void *consumer(void *arg)
+{
+   long n = 0;
+
+   while (pop() >= 0)
+      n++;
+   return (void *)n;
+}
+
+double now()
+{
+   struct timeval t;
+
+   gettimeofday(&t, NULL);
+   return t.tv_sec + t.tv_usec / 1e6;
+}
+
+void run(char *name)
+{
+   pthread_t p[producers], c[consumers];
+   long got = 0, n;
+   double start, secs;
+   int i;
+
+   start = now();
+   for (i = 0; i < consumers; i++)
+      pthread_create(&c[i], NULL, consumer, NULL);
+   for (i = 0; i < producers; i++)
+      pthread_create(&p[i], NULL, producer, (void *)(long)(items / producers));
+   for (i = 0; i < producers; i++)
+      pthread_join(p[i], NULL);
+   for (i = 0; i < consumers; i++)
+      push(-1);
+   for (i = 0; i < consumers; i++) {
+      pthread_join(c[i], (void **)&n);
+      got += n;
+   }
+   secs = now() - start;
+
+   printf("%-7s %ld items in %.3f s, %.2f M/s\n", name, got, secs, got / secs / 1e6);
+}
+
+int main(int argc, char *argv[])
+{
+   int opt;
+
+   while ((opt = getopt(argc, argv, "p:c:n:b:")) != -1) {
+      switch (opt) {
+      case 'p':
+         producers = atoi(optarg);
+         break;
+      case 'c':
+         consumers = atoi(optarg);
+         break;
+      case 'n':
+         items = atoi(optarg);
+         break;
+      case 'b':
+         buffers = atoi(optarg);
+         break;
+      default:
+         fprintf(stderr, "Usage: %s [-p <producers>] [-c <consumers>] [-n <items>] [-b <buffers>]\n", argv[0]);
+         exit(1);
+      }
+   }
+   if (producers < 1 || consumers < 1 || items < 1 || buffers < 1) {
+      fprintf(stderr, "error: arguments must be > 0\n");
+      exit(1);
+   }
+
+   printf("%d producers, %d consumers, %d buffers\n", producers, consumers, buffers);
+   lockedInit(&locked, buffers);
+   run("locked");
+   useRing = 1;
+   ringInit(&ring, buffers);
+   run("ring");
+   return 0;
+}
@@ -2,37 +2,166 @@
 // server.c: A very, very simple web server
 //
 // To run:
-//  server <portnum (above 2000)>
+//  server [-e] [-s fifo|sff|rr] [-a <acceptors> [-p]] [-t <idle secs>] [-r <requests>]
+//         [-c <cgi program>]... <portnum (above 2000)> <threads> <buffers>
 //
 // Repeatedly handles HTTP requests sent to this port number.
 // Most of the work is done within routines written in request.c
 //
+// Connections stay open across requests (HTTP/1.1 keep-alive) until the
+// client closes them, sends no request for -t seconds, or has made -r
+// requests. In the threaded mode a worker stays with its connection while
+// requests keep coming. Between requests it waits in short polls, and
+// closes the connection as soon as other connections are waiting for a
+// worker, so that idle clients can't hold every worker for -t seconds. The
+// price is that under load an idle client loses its connection and has to
+// open a new one; -e keeps idle connections without tying up workers.
+//
+// With -e, one thread reads requests from every connection with epoll
+// (see event.c), and only complete requests go to the worker threads.
+//
+// -s picks the order in which waiting connections go to the workers:
+//   fifo  the order they came in (the default)
+//   sff   smallest file first, going by the request line, so that small
+//         files don't wait behind big ones. Requests it can't size
+//         (CGI programs, errors) count as smallest.
+//   rr    round robin over the clients' IP addresses, so that no client
+//         can crowd out the others
+// In the threaded mode only a connection's first request is scheduled;
+// with -e every request is.
+//
+// fifo needs no ordering, so it hands connections over through the
+// lock-free ring in ring.c instead, and threads only sleep (on a futex)
+// while it is empty or full.
+//
+// -a opens that many listening sockets on the port with SO_REUSEPORT, and
+// the kernel spreads new connections over them. In the threaded mode each
+// has its own acceptor thread; with -e the event thread takes from all of
+// them. With -p as well (threaded mode only), each listener gets its own
+// queue of <buffers> and its share of the <threads> workers, all pinned to
+// one CPU, so that a connection stays on the core that accepted it.
+//
+// -c names a CGI program, by its path in URLs (like /output.cgi), to keep
+// running between requests instead of starting it for each one (see
+// cgi.c). It has to be built with cgilib.c. -c can be given more than once.
+//
+// Every request goes in an access log on stdout, in the Common Log Format,
+// which log.c writes out in batches.
+//
 
+#define _GNU_SOURCE
 #include <pthread.h>
+#include <sched.h>
+#include <poll.h>
+#include <netinet/tcp.h>
 #include "cs537.h"
 #include "request.h"
+#include "event.h"
+#include "ring.h"
+#include "log.h"
+#include "cgi.h"
+
+#define FIFO 0
+#define SFF 1
+#define RR 2
+
+#define CLIENTS 1024  // clients rr tells apart (by a hash of the address)
+#define IDLE_POLL 50  // ms a worker waits for the next request before it
+                      // looks whether other connections need it
+
+// A waiting connection, and its place in line
+typedef struct {
+  int fd;
+  unsigned long key;  // lowest goes first
+  unsigned long seq;  // and first come, first served among equals
+} job_t;
 
-pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_cond_t full = PTHREAD_COND_INITIALIZER;
-pthread_cond_t empty = PTHREAD_COND_INITIALIZER;
+// Connections waiting for a pool of workers
+typedef struct {
+  ring_t ring;    // fifo
+  pthread_mutex_t mutex;
+  pthread_cond_t full;
+  pthread_cond_t empty;
+  job_t *buffer;  // sff and rr: a binary heap, ordered by key and seq
+  int max;
+  int count;
+  unsigned long seq;
+  unsigned long lastround[CLIENTS]; // rr: the last round each client is in
+  unsigned long curround;         // rr: the round being served
+  int cpu;        // -p: where its acceptor and workers run (-1 anywhere)
+} queue_t;
 
-int *buffer;
-int max = 0;
-int fill = 0;
-int use = 0;
-int count = 0;
+// A listening socket, and the queue its connections go to
+typedef struct {
+  int fd;
+  queue_t *q;
+} listener_t;
+
+queue_t *queues;
+
+int policy = FIFO; // -s
+int acceptors = 1; // -a: listening sockets
+int pools = 0;     // -p: a queue and workers per listener
+
+int reactor = 0; // -e: event-driven front end
+int idle_timeout = 5; // -t: seconds a connection may wait between requests
+int max_requests = 100; // -r: requests served on one connection
+
+void usage(char *name)
+{
+    fprintf(stderr, "Usage: %s [-e] [-s fifo|sff|rr] [-a <acceptors> [-p]] [-t <idle secs>] [-r <requests>] [-c <cgi program>]... <port> <threads> <buffers>\n", name);
+    exit(1);
+}
 
 // CS537: Parse the new arguments too
 void getargs(int *port, int *threads, int *buffers, int argc, char *argv[])
 {
-    if (argc != 4) { 
-	    fprintf(stderr, "Usage: %s <port> <threads> <buffers>\n", argv[0]);
-	    exit(1);
+    int opt;
+
+    while ((opt = getopt(argc, argv, "es:a:pt:r:c:")) != -1) {
+      switch (opt) {
+      case 'e':
+        reactor = 1;
+        break;
+      case 's':
+        if (!strcmp(optarg, "fifo"))
+          policy = FIFO;
+        else if (!strcmp(optarg, "sff"))
+          policy = SFF;
+        else if (!strcmp(optarg, "rr"))
+          policy = RR;
+        else
+          usage(argv[0]);
+        break;
+      case 'a':
+        acceptors = atoi(optarg);
+        break;
+      case 'p':
+        pools = 1;
+        break;
+      case 't':
+        idle_timeout = atoi(optarg);
+        break;
+      case 'r':
+        max_requests = atoi(optarg);
+        break;
+      case 'c':
+        if (cgiPoolAdd(optarg) < 0) {
+          fprintf(stderr, "error: out of memory");
+          exit(1);
+        }
+        break;
+      default:
+        usage(argv[0]);
+      }
+    }
+    if (argc - optind != 3) { 
+	    usage(argv[0]);
     }
     
-    *port = atoi(argv[1]);
-    *threads = atoi(argv[2]);
-    *buffers = atoi(argv[3]); 
+    *port = atoi(argv[optind]);
+    *threads = atoi(argv[optind + 1]);
+    *buffers = atoi(argv[optind + 2]); 
     
     if (*port < 2000) {
       fprintf(stderr, "error: port must be >= 2000");
@@ -48,68 +177,272 @@ void getargs(int *port, int *threads, int *buffers, int argc, char *argv[])
       fprintf(stderr, "error: buffers must be > 0");
       exit(1);
     }
+
+    if (idle_timeout < 1 || max_requests < 1) {
+      fprintf(stderr, "error: idle secs and requests must be > 0");
+      exit(1);
+    }
+
+    if (acceptors < 1 || (pools && (reactor || *threads < acceptors))) {
+      fprintf(stderr, "error: acceptors must be > 0, and -p needs at least as many threads and no -e");
+      exit(1);
+    }
+}
+
+int before(job_t *a, job_t *b) {
+  return a->key < b->key || (a->key == b->key && a->seq < b->seq);
+}
+
+void queueInit(queue_t *q, int buffers, int cpu) {
+  memset(q, 0, sizeof(queue_t));
+  ringInit(&q->ring, buffers);
+  pthread_mutex_init(&q->mutex, NULL);
+  pthread_cond_init(&q->full, NULL);
+  pthread_cond_init(&q->empty, NULL);
+  q->max = buffers;
+  q->buffer = (job_t *)malloc(sizeof(job_t)*buffers);
+  q->cpu = cpu;
+}
+
+void put(queue_t *q, int value, unsigned long key) {
+  job_t job = { value, key, q->seq++ };
+  job_t *buffer = q->buffer;
+  int i = q->count++;
+
+  // Move it up past the ones that should go after it
+  while (i > 0 && before(&job, &buffer[(i - 1) / 2])) {
+    buffer[i] = buffer[(i - 1) / 2];
+    i = (i - 1) / 2;
+  }
+  buffer[i] = job;
+}
+
+int get(queue_t *q) {
+  job_t *buffer = q->buffer;
+  job_t tmp = buffer[0];
+  job_t last = buffer[--q->count];
+  int i = 0, child;
+
+  // Move the last one down from the top to where it belongs
+  while ((child = 2 * i + 1) < q->count) {
+    if (child + 1 < q->count && before(&buffer[child + 1], &buffer[child]))
+      child++;
+    if (!before(&buffer[child], &last))
+      break;
+    buffer[i] = buffer[child];
+    i = child;
+  }
+  buffer[i] = last;
+
+  if (policy == RR)
+    q->curround = tmp.key;
+  return tmp.fd;
+}
+
+// Where a connection goes in line. client is its IP address, and the n
+// bytes at req are what it has sent so far.
+unsigned long schedkey(queue_t *q, unsigned client, char *req, size_t n) {
+  unsigned long *last;
+
+  switch (policy) {
+  case SFF:
+    return requestSize(req, n);
+  case RR:
+    // Each client's next request goes in the round after its last one
+    last = &q->lastround[ntohl(client) % CLIENTS];
+    *last = (*last > q->curround ? *last : q->curround) + 1;
+    return *last;
+  default:
+    return 0;
+  }
 }
 
-void put(int value) {
-  buffer[fill] = value;
-  fill = (fill + 1) % max;
-  count++;
+void enqueue (queue_t *q, int connfd, unsigned client, char *req, size_t n) {
+  unsigned long key = policy == SFF ? schedkey(q, client, req, n) : 0;
+
+  if (policy == FIFO) {
+    ringPush(&q->ring, connfd);
+    return;
+  }
+
+  pthread_mutex_lock(&q->mutex);
+  while (q->count == q->max) 
+    pthread_cond_wait(&q->empty, &q->mutex);
+  if (policy == RR)
+    key = schedkey(q, client, req, n);
+  put(q, connfd, key);
+  pthread_cond_signal(&q->full);
+  pthread_mutex_unlock(&q->mutex); 
+}
+
+// For event.c, which has the one queue
+void producer (int connfd, unsigned client, char *req, size_t n) {
+  enqueue(&queues[0], connfd, client, req, n);
+}
+
+// Run the calling thread only on cpu
+void pin(int cpu) {
+  cpu_set_t set;
+
+  if (cpu < 0)
+    return;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
 }
 
-int get() {
-  int tmp = buffer[use];
-  use = (use + 1) % max;
-  count--;
-  return tmp;
+// How many connections are waiting in q for a worker
+int waiting(queue_t *q) {
+  int n;
+
+  if (policy == FIFO)
+    return ringCount(&q->ring);
+  pthread_mutex_lock(&q->mutex);
+  n = q->count;
+  pthread_mutex_unlock(&q->mutex);
+  return n;
 }
 
-void producer (int connfd) {
-  pthread_mutex_lock(&mutex);
-  while (count == max) 
-    pthread_cond_wait(&empty, &mutex);
-  put(connfd);
-  pthread_cond_signal(&full);
-  pthread_mutex_unlock(&mutex); 
+// Wait for the next request on c. Returns 1 once there is something to
+// read (or it's already buffered, pipelined after the last request), or 0
+// if the connection should be closed instead: it has been idle for -t
+// seconds, or was idle while connections in q are waiting for a worker.
+int serveWait(queue_t *q, conn_t *c) {
+  struct pollfd p = { c->fd, POLLIN, 0 };
+  int idle = 0, rc;
+
+  if (c->rio.rio_cnt > 0)
+    return 1;
+  while ((rc = poll(&p, 1, IDLE_POLL)) <= 0) {
+    if (rc < 0 && errno != EINTR)
+      return 0;
+    if (rc == 0)
+      idle += IDLE_POLL;
+    if (idle >= idle_timeout * 1000 || waiting(q) > 0)
+      return 0;
+  }
+  return 1;
+}
+
+// Handle the requests on a blocking connection, which came from q
+void serve(queue_t *q, int fd) {
+  struct timeval tv = { idle_timeout, 0 };
+  struct sockaddr_in addr;
+  socklen_t len = sizeof(addr);
+  conn_t c;
+
+  // A read waiting longer than this fails, and closes the connection
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+  connInit(&c, fd, 0);
+  c.requests = max_requests;
+  // For the access log
+  if (getpeername(fd, (SA *)&addr, &len) == 0)
+    c.client = addr.sin_addr.s_addr;
+  while (requestHandle(&c) && serveWait(q, &c))
+    ;
+  connFree(&c);
+  Close(fd);
 }
 
 void *consumer (void *arg) { 
+  queue_t *q = arg;
+  pin(q->cpu);
   while (1) { 
-  pthread_mutex_lock(&mutex);
-  while (count == 0) 
-    pthread_cond_wait(&full, &mutex);
-  int fd = get();
-  pthread_cond_signal(&empty);
-  pthread_mutex_unlock(&mutex); 
-  requestHandle(fd);
-  Close(fd);
+    int fd;
+    if (policy == FIFO) {
+      fd = ringPop(&q->ring);
+    } else {
+      pthread_mutex_lock(&q->mutex);
+      while (q->count == 0) 
+        pthread_cond_wait(&q->full, &q->mutex);
+      fd = get(q);
+      pthread_cond_signal(&q->empty);
+      pthread_mutex_unlock(&q->mutex); 
+    }
+    if (reactor)
+      eventServe(fd);
+    else
+      serve(q, fd);
   } 
 }
 
+// Take connections from one listening socket
+void *acceptor (void *arg) {
+  listener_t *l = arg;
+  struct sockaddr_in clientaddr;
+  socklen_t clientlen;
+  int connfd;
+
+  pin(l->q->cpu);
+  while (1) {
+	    clientlen = sizeof(clientaddr);
+	    // Workers use the connection blocking, so only ask for close-on-exec
+	    // (which keeps it out of CGI programs) and save the fcntl() for that
+	    if ((connfd = accept4(l->fd, (SA *)&clientaddr, &clientlen, SOCK_CLOEXEC)) < 0) {
+	      if (errno == EMFILE || errno == ENFILE)
+	        usleep(10000);  // let some connections close first
+	      continue;
+	    }
+	    // 
+	    // CS537: In general, don't handle the request in the main thread.
+	    // Save the relevant info in a buffer and have one of the worker threads 
+	    // do the work.
+      char req[MAXLINE];
+      ssize_t n = 0;
+      if (policy == SFF && (n = recv(connfd, req, sizeof(req), MSG_PEEK | MSG_DONTWAIT)) < 0)
+        n = 0;
+      enqueue(l->q, connfd, clientaddr.sin_addr.s_addr, req, n);
+  }
+}
+
 int main(int argc, char *argv[])
 {
-    int listenfd, connfd, port, clientlen;
-    int threads, buffers;
-    struct sockaddr_in clientaddr;
+    int port, threads, buffers, ncpus, i;
+    int *listenfds;
+    listener_t *listeners;
 
     getargs(&port, &threads, &buffers, argc, argv );
-    
-    int i;
+
+    // A client hanging up early shouldn't take the server down with it
+    signal(SIGPIPE, SIG_IGN);
+
+    // The access log goes to stdout, in batches (see log.c)
+    logInit(STDOUT_FILENO);
+
+    int nqueues = pools ? acceptors : 1;
+    ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    queues = (queue_t *)malloc(sizeof(queue_t)*nqueues);
+    for (i = 0; i < nqueues; i++)
+      queueInit(&queues[i], buffers, pools ? i % ncpus : -1);
+
+    // With pools, the workers are shared out among the queues
     for (i = 0; i < threads; i++) {
       pthread_t worker;
-      pthread_create(&worker, NULL, consumer, NULL); 
+      pthread_create(&worker, NULL, consumer, &queues[i % nqueues]); 
     }
-    
-    max = buffers;
-    buffer = (int *)malloc(sizeof(int)*buffers);
 
-    listenfd = Open_listenfd(port);
-    while (1) {
-	    clientlen = sizeof(clientaddr);
-	    connfd = Accept(listenfd, (SA *)&clientaddr, (socklen_t *) &clientlen);
-	    // 
-	    // CS537: In general, don't handle the request in the main thread.
-	    // Save the relevant info in a buffer and have one of the worker threads 
-	    // do the work.
-      producer(connfd);
+    listenfds = (int *)malloc(sizeof(int)*acceptors);
+    listeners = (listener_t *)malloc(sizeof(listener_t)*acceptors);
+    for (i = 0; i < acceptors; i++) {
+      listenfds[i] = acceptors > 1 ? Open_reuseport_listenfd(port) : Open_listenfd(port);
+      // Keep it out of CGI programs, which may outlive us
+      fcntl(listenfds[i], F_SETFD, FD_CLOEXEC);
+      // sff needs to see the request line, so only take connections once
+      // the client has sent something
+      if (policy == SFF && !reactor)
+        setsockopt(listenfds[i], IPPROTO_TCP, TCP_DEFER_ACCEPT, &idle_timeout, sizeof(idle_timeout));
+      listeners[i].fd = listenfds[i];
+      listeners[i].q = &queues[pools ? i : 0];
+    }
+
+    if (reactor)
+      eventLoop(listenfds, acceptors);
+
+    for (i = 1; i < acceptors; i++) {
+      pthread_t thread;
+      pthread_create(&thread, NULL, acceptor, &listeners[i]);
     }
+    acceptor(&listeners[0]);
+    return 0;
 }